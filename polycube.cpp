@@ -1,14 +1,296 @@
 #include <set>
+#include <unordered_set>
+#include <unordered_map>
 #include <map>
 #include <array>
 #include <ctime>
 #include <string>
+#include <cstdio>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <condition_variable>
+#include <deque>
+#include <queue>
 #include <vector>
+#include <cstdint>
+#include <cmath>
 #include <fstream>
 #include <cassert>
+#include <cstdlib>
+#include <new>
+#include <memory>
+#include <charconv>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <algorithm>
 
+// number of heap allocations, counted only when compiled with -DPOLYCUBE_COUNT_ALLOCATIONS
+std::atomic<long long> allocation_count(0);
+
+#ifdef POLYCUBE_COUNT_ALLOCATIONS
+__attribute__((noinline)) void *operator new(std::size_t size)
+{
+    allocation_count++;
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+#endif
+
+// reports number of heap allocations made during its lifetime, used to check that hot paths do not allocate
+class allocation_stage
+{
+public:
+    allocation_stage(const char *name) : name(name), start(allocation_count) {}
+    ~allocation_stage()
+    {
+#ifdef POLYCUBE_COUNT_ALLOCATIONS
+        std::cerr << "Stage " << name << " made " << allocation_count - start << " heap allocations." << std::endl;
+#endif
+    }
+
+private:
+    const char *name;
+    long long start;
+};
+
+// random numbers of the current thread, seeded for every shape, so that shapes processed in parallel don't share them
+thread_local std::mt19937 random_engine;
+
+// cancellation shared by tasks, either explicit or after the deadline
+class cancel_token
+{
+public:
+    // no deadline for zero seconds
+    explicit cancel_token(double seconds = 0)
+    {
+        if (seconds > 0)
+            deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    }
+    void cancel() { stopped = true; }
+    bool cancelled() const
+    {
+        return stopped || (deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= deadline);
+    }
+
+private:
+    std::atomic<bool> stopped{false};
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+};
+
+// work-stealing scheduler, every thread has its own deques, one for each group, it runs its newest tasks and steals
+// the oldest tasks of others, the thread, that started the scheduler, owns queue 0 and runs tasks only while it waits
+// for a task group
+class task_scheduler
+{
+public:
+    task_scheduler() { queues.emplace_back(new queue()); }
+    ~task_scheduler() { stop(); }
+    void start(int threads);
+    void stop();
+    // number of threads including the one, that started the scheduler
+    int threads() const { return queues.size(); }
+    // tasks go to the deque of the group in the queue of the current thread
+    void spawn(std::function<void()> task, const void *group);
+    // runs one task of the group, any task for null group, returns false if there was none
+    bool run_one(const void *group);
+    void print_stats(std::ostream &os) const;
+
+private:
+    struct task
+    {
+        std::function<void()> run;
+        // order of spawning, it decides between groups, when any task can be taken
+        long long order;
+    };
+    struct queue
+    {
+        std::mutex lock;
+        // deques without tasks are removed, so that only groups with tasks are visited
+        std::map<const void *, std::deque<task>> groups;
+        std::atomic<long long> executed{0}, stolen{0}, idle{0};
+    };
+    std::vector<std::unique_ptr<queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<bool> stopping{false};
+    std::atomic<long long> queued{0}, spawned{0};
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    static thread_local int current;
+    bool take(const void *group, task &t);
+    void work(int id);
+};
+
+thread_local int task_scheduler::current = 0;
+
+void task_scheduler::start(int threads)
+{
+    stop();
+    stopping = false;
+    while ((int)queues.size() < threads)
+        queues.emplace_back(new queue());
+    for (int id = 1; id < (int)queues.size(); id++)
+        workers.emplace_back(&task_scheduler::work, this, id);
+}
+
+void task_scheduler::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &&w : workers)
+        w.join();
+    workers.clear();
+}
+
+void task_scheduler::spawn(std::function<void()> task, const void *group)
+{
+    {
+        std::lock_guard<std::mutex> guard(queues[current]->lock);
+        queues[current]->groups[group].push_back({std::move(task), spawned++});
+    }
+    // the counter changes under the lock of sleeping workers, so that none of them misses the task
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+// takes the newest task of own queue, otherwise the oldest task of another queue
+bool task_scheduler::take(const void *group, task &t)
+{
+    for (int k = 0; k < (int)queues.size(); k++)
+    {
+        queue &q = *queues[(current + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(q.lock);
+        auto chosen = group ? q.groups.find(group) : q.groups.end();
+        // without group the deque with the newest own or the oldest stolen task is chosen
+        if (!group)
+            for (auto it = q.groups.begin(); it != q.groups.end(); it++)
+                if (chosen == q.groups.end() || (k ? it->second.front().order < chosen->second.front().order : it->second.back().order > chosen->second.back().order))
+                    chosen = it;
+        if (chosen == q.groups.end())
+            continue;
+        // own deque from the back, the others from the front
+        std::deque<task> &tasks = chosen->second;
+        t = std::move(k ? tasks.front() : tasks.back());
+        if (k)
+            tasks.pop_front();
+        else
+            tasks.pop_back();
+        if (tasks.empty())
+            q.groups.erase(chosen);
+        queued--;
+        queues[current]->stolen += k > 0;
+        return true;
+    }
+    return false;
+}
+
+bool task_scheduler::run_one(const void *group)
+{
+    task t;
+    if (!take(group, t))
+        return false;
+    // counted before running, the waiting thread may print the statistics as soon as the task finishes
+    queues[current]->executed++;
+    t.run();
+    return true;
+}
+
+void task_scheduler::work(int id)
+{
+    current = id;
+    while (!stopping)
+    {
+        if (run_one(NULL))
+            continue;
+        queues[id]->idle++;
+        std::unique_lock<std::mutex> guard(sleep_lock);
+        wake.wait(guard, [this]()
+                  { return stopping || queued > 0; });
+    }
+}
+
+void task_scheduler::print_stats(std::ostream &os) const
+{
+    for (int id = 0; id < (int)queues.size(); id++)
+        os << "Thread " << id << " ran " << queues[id]->executed << " tasks, " << queues[id]->stolen << " of them stolen, and was idle " << queues[id]->idle << " times." << std::endl;
+}
+
+// scheduler shared by the whole program, main starts its threads
+task_scheduler &scheduler()
+{
+    static task_scheduler instance;
+    return instance;
+}
+
+// tasks, that can be waited for together, the waiting thread runs tasks of the group meanwhile
+// and sleeps, when other threads run all of them, until one finishes or a new one is spawned
+class task_group
+{
+public:
+    explicit task_group(task_scheduler &s) : s(s) {}
+    ~task_group() { wait(); }
+    void spawn(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending++;
+        }
+        s.spawn([this, task]()
+                {
+                    task();
+                    // the group may be destroyed as soon as the lock is released
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (!--pending)
+                        changed.notify_all(); },
+                this);
+        std::lock_guard<std::mutex> guard(lock);
+        spawned++;
+        changed.notify_all();
+    }
+    void wait()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (pending)
+        {
+            long long seen = spawned;
+            guard.unlock();
+            bool ran = s.run_one(this);
+            guard.lock();
+            if (!ran)
+                changed.wait(guard, [&]()
+                             { return !pending || spawned != seen; });
+        }
+    }
+
+private:
+    task_scheduler &s;
+    std::mutex lock;
+    std::condition_variable changed;
+    int pending = 0;
+    long long spawned = 0;
+};
+
+// offsets of neighboring positions in space, in the order left, right, down, up, front, back
+constexpr int offsets_3d[6][3] = {{-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}};
+// offsets of neighboring positions in plane, in the order up, left, down, right
+constexpr int offsets_2d[4][2] = {{0, 1}, {-1, 0}, {0, -1}, {1, 0}};
+
 // struct representing triplet of coordinates
 struct position
 {
@@ -43,16 +325,12 @@ struct position
     position front() const { return {x, y, z - 1}; }
     position back() const { return {x, y, z + 1}; }
 
+    position neighbor(int dir) const { return {x + offsets_3d[dir][0], y + offsets_3d[dir][1], z + offsets_3d[dir][2]}; }
+
     // list of neighboring positions
-    std::vector<position> neighbors() const
+    std::array<position, 6> neighbors() const
     {
-        return {
-            left(),
-            right(),
-            down(),
-            up(),
-            front(),
-            back()};
+        return {neighbor(0), neighbor(1), neighbor(2), neighbor(3), neighbor(4), neighbor(5)};
     }
 };
 
@@ -61,7 +339,6 @@ struct cube
 {
     int index;
     position pos;
-    bool visited;
 };
 
 // it might be useful to distinguish different types of squares
@@ -169,10 +446,12 @@ struct plane_position
     plane_position left() const { return {x - 1, y}; }
     plane_position right() const { return {x + 1, y}; }
 
+    plane_position neighbor(direction::direction dir) const { return {x + offsets_2d[dir][0], y + offsets_2d[dir][1]}; }
+
     // order matters
-    std::vector<plane_position> neighbors() const
+    std::array<plane_position, 4> neighbors() const
     {
-        return {up(), left(), down(), right()};
+        return {neighbor(direction::up), neighbor(direction::left), neighbor(direction::down), neighbor(direction::right)};
     }
 };
 
@@ -212,30 +491,358 @@ public:
     std::map<plane_position, square> squares;
 };
 
+// move of the local search, cuts one edge of the spanning tree and links the two parts by another one
+struct swap_move
+{
+    face cut_from, cut_to, link_from, link_to;
+};
+
+// placement of faces in the plane given by a spanning tree, together with counts used by objectives
+struct layout
+{
+    // position and up direction of every face
+    std::map<face, std::pair<plane_position, direction::direction>> placed;
+    std::map<plane_position, int> cells;
+    std::map<int, int> columns, rows;
+
+    void add(face f, plane_position pos, direction::direction up)
+    {
+        placed[f] = {pos, up};
+        cells[pos]++;
+        columns[pos.x]++;
+        rows[pos.y]++;
+    }
+};
+
+// rounds down, unlike the integer division
+int floor_div(int a, int b)
+{
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+// set of cells packed into rows of 64-bit words
+// when the bounding box is much larger than the number of cells, only the nonzero words are kept in a hash map
+struct cell_bitmap
+{
+    int minx = 0, miny = 0, width = 0, height = 0, words = 0;
+    std::vector<uint64_t> rows;
+    std::unordered_map<long long, uint64_t> sparse_rows;
+    bool sparse = false;
+
+    cell_bitmap() {}
+    cell_bitmap(const std::vector<plane_position> &cells)
+    {
+        if (cells.empty())
+            return;
+        int maxx = cells[0].x, maxy = cells[0].y;
+        minx = cells[0].x;
+        miny = cells[0].y;
+        for (auto pos : cells)
+        {
+            minx = std::min(minx, pos.x);
+            miny = std::min(miny, pos.y);
+            maxx = std::max(maxx, pos.x);
+            maxy = std::max(maxy, pos.y);
+        }
+        width = maxx - minx + 1;
+        height = maxy - miny + 1;
+        words = (width + 63) / 64;
+        sparse = (long long)words * height > 4 * (long long)cells.size() + 1024;
+        if (!sparse)
+            rows.assign((size_t)words * height, 0);
+        for (auto pos : cells)
+            set(pos, true);
+    }
+
+    void set(plane_position pos, bool value)
+    {
+        int col = pos.x - minx;
+        long long i = (long long)(pos.y - miny) * words + col / 64;
+        uint64_t &word = sparse ? sparse_rows[i] : rows[i];
+        word = value ? word | 1ULL << (col % 64) : word & ~(1ULL << (col % 64));
+    }
+
+    uint64_t word(int row, int q) const
+    {
+        if (!sparse)
+            return rows[(size_t)row * words + q];
+        auto it = sparse_rows.find((long long)row * words + q);
+        return it == sparse_rows.end() ? 0 : it->second;
+    }
+
+    // number of common cells with other bitmap shifted by (dx, dy), computed by shifted AND of rows
+    long long overlap(const cell_bitmap &other, int dx, int dy) const
+    {
+        long long count = 0;
+        int shift = other.minx + dx - minx;
+        int first = std::max(0, miny - other.miny - dy), last = std::min(other.height, miny + height - other.miny - dy);
+        for (int i = first; i < last; i++)
+        {
+            int row = other.miny + dy + i - miny;
+            for (int k = 0; k < other.words; k++)
+            {
+                uint64_t bits = other.word(i, k);
+                if (!bits)
+                    continue;
+                // bits of the word land at columns start .. start + 63 of this bitmap
+                int start = 64 * k + shift;
+                int q = floor_div(start, 64), offset = start - 64 * q;
+                if (q >= 0 && q < words)
+                    count += __builtin_popcountll(word(row, q) & bits << offset);
+                if (offset && q + 1 >= 0 && q + 1 < words)
+                    count += __builtin_popcountll(word(row, q + 1) & bits >> (64 - offset));
+            }
+        }
+        return count;
+    }
+};
+
+// what a move changes, the cut and linked edge and old and new cells of the faces that moved
+// if the objective does not need the moved faces, only the number of occupied cells after the move is known
+struct move_effect
+{
+    swap_move m;
+    std::vector<std::pair<plane_position, plane_position>> moved;
+    long long cells_after = -1;
+};
+
+// everything about the two parts of a cut tree that does not depend on the new edge
+struct cut_state
+{
+    std::vector<face> moving;
+    // whether the moving part contains link_to of the moves
+    bool moving_link_to;
+    // cells of the moving part rotated 0 to 3 times counterclockwise around the origin
+    std::array<cell_bitmap, 4> rotations;
+    // cells of the whole layout shared by all cuts and cells occupied only by the moving part, that are not in the fixed one
+    const cell_bitmap *all;
+    cell_bitmap only_moving;
+    long long fixed_cells, moving_cells;
+};
+
+// goal of the local search, higher value is better
+// delta has to depend only on the moved faces and the two edges of the move, not on the whole surface
+class objective
+{
+public:
+    virtual ~objective() {}
+    virtual long long value(const layout &l, const std::map<face, std::set<face>> &tree) const = 0;
+    virtual long long delta(const layout &l, const move_effect &e) const = 0;
+    // objectives depending only on the number of occupied cells can skip placing the moved faces
+    virtual bool needs_moved() const { return true; }
+};
+
+// number of occupied cells, so the fewer overlaps the better
+class overlap_objective : public objective
+{
+public:
+    long long value(const layout &l, const std::map<face, std::set<face>> &) const override
+    {
+        return l.cells.size();
+    }
+    long long delta(const layout &l, const move_effect &e) const override
+    {
+        if (e.cells_after >= 0)
+            return e.cells_after - (long long)l.cells.size();
+        std::map<plane_position, int> diff;
+        for (auto &&c : e.moved)
+        {
+            diff[c.first]--;
+            diff[c.second]++;
+        }
+        long long d = 0;
+        for (auto &&pair : diff)
+        {
+            auto it = l.cells.find(pair.first);
+            int count = it == l.cells.end() ? 0 : it->second;
+            d += (count + pair.second > 0) - (count > 0);
+        }
+        return d;
+    }
+    bool needs_moved() const override { return false; }
+};
+
+// negative area of the bounding box, for cutting the unfoldings from sheets
+class bounding_box_objective : public objective
+{
+public:
+    long long value(const layout &l, const std::map<face, std::set<face>> &) const override
+    {
+        return -(long long)(l.columns.rbegin()->first - l.columns.begin()->first + 1) * (l.rows.rbegin()->first - l.rows.begin()->first + 1);
+    }
+    long long delta(const layout &l, const move_effect &e) const override
+    {
+        std::map<int, int> dx, dy;
+        for (auto &&c : e.moved)
+        {
+            dx[c.first.x]--;
+            dx[c.second.x]++;
+            dy[c.first.y]--;
+            dy[c.second.y]++;
+        }
+        long long old_area = -value(l, {});
+        return old_area - (long long)size(l.columns, dx) * size(l.rows, dy);
+    }
+
+private:
+    // extent of coordinates after applying the difference, only emptied lines at the border are skipped
+    static int size(const std::map<int, int> &counts, const std::map<int, int> &diff)
+    {
+        auto count = [&](int key)
+        {
+            auto it = counts.find(key);
+            auto d = diff.find(key);
+            return (it == counts.end() ? 0 : it->second) + (d == diff.end() ? 0 : d->second);
+        };
+        auto lo = counts.begin();
+        while (lo != counts.end() && !count(lo->first))
+            lo++;
+        auto hi = counts.rbegin();
+        while (hi != counts.rend() && !count(hi->first))
+            hi++;
+        int min = lo == counts.end() ? 1e9 : lo->first, max = hi == counts.rend() ? -1e9 : hi->first;
+        for (auto &&pair : diff)
+        {
+            if (count(pair.first) > 0)
+            {
+                min = std::min(min, pair.first);
+                max = std::max(max, pair.first);
+            }
+        }
+        return max - min + 1;
+    }
+};
+
+// negative number of tree edges between faces of different direction, every such edge is a fold
+class fold_objective : public objective
+{
+public:
+    long long value(const layout &, const std::map<face, std::set<face>> &tree) const override
+    {
+        long long folds = 0;
+        for (auto &&pair : tree)
+            for (auto nb : pair.second)
+                folds += nb.dir != pair.first.dir;
+        return -folds / 2;
+    }
+    long long delta(const layout &, const move_effect &e) const override
+    {
+        return (e.m.cut_from.dir != e.m.cut_to.dir) - (e.m.link_from.dir != e.m.link_to.dir);
+    }
+    bool needs_moved() const override { return false; }
+};
+
+// the original score, 100 for every occupied cell and 2 for every edge between faces of the same direction
+class classic_objective : public objective
+{
+public:
+    long long value(const layout &l, const std::map<face, std::set<face>> &tree) const override
+    {
+        long long same = 0;
+        for (auto &&pair : tree)
+            for (auto nb : pair.second)
+                same += nb.dir == pair.first.dir;
+        return 100 * overlaps.value(l, tree) + same;
+    }
+    long long delta(const layout &l, const move_effect &e) const override
+    {
+        return 100 * overlaps.delta(l, e) + 2 * ((e.m.link_from.dir == e.m.link_to.dir) - (e.m.cut_from.dir == e.m.cut_to.dir));
+    }
+    bool needs_moved() const override { return false; }
+
+private:
+    overlap_objective overlaps;
+};
+
+// strategies for the initial spanning tree of the local search
+enum class start_strategy
+{
+    random,
+    bands,
+    greedy,
+    grown
+};
+
+// edge of the surface graph with the smaller face first
+std::pair<face, face> edge_key(face a, face b)
+{
+    return a < b ? std::make_pair(a, b) : std::make_pair(b, a);
+}
+
+// number of spanning trees of the surface graph, the exact digits are empty if they were not computed
+struct spanning_tree_count
+{
+    double log10 = 0;
+    std::string exact;
+};
+
+// one level of the multilevel search, from the coarsest one
+struct level_report
+{
+    int level, patches, rounds, overlaps;
+};
+
+// outcome of the exhaustive search
+enum class search_result
+{
+    found,
+    none,
+    aborted
+};
+
 class surface
 {
 public:
     std::map<face, std::array<face, 4>> graph;
     void connect(face f1, direction::direction d1, face f2, direction::direction d2);
     std::map<face, std::set<face>> random_spanning_tree();
+    std::map<face, std::set<face>> bands_spanning_tree();
+    std::map<face, std::set<face>> greedy_spanning_tree();
+    std::map<face, std::set<face>> grown_spanning_tree(face start);
+    std::map<face, std::set<face>> ranked_spanning_tree(const std::function<int(face, face)> &rank);
+    std::map<face, std::set<face>> spanning_tree(start_strategy strategy);
+    bool grow_unfolding(int attempts = 64);
+    spanning_tree_count count_spanning_trees(int max_digits = 300) const;
+    search_result exhaustive_unfolding(long long max_nodes, const cancel_token &cancel);
+    bool multilevel_unfolding(int threads, const objective &obj, std::vector<level_report> &report, const cancel_token &cancel);
     unfolding get_bad_unfolding();
     int score();
     bool improve();
+    bool improve_parallel(int threads, const objective &obj);
+    long long value(const objective &obj) const;
     void try_unfold();
+    void restrict_moves(const std::function<bool(face, face)> &allowed);
+    int derive_constraints();
+    int saddle_count() const { return saddles.size(); }
 
 private:
     std::map<face, std::set<face>> tree;
+    // edges, that improve_parallel may cut or link, all of them if empty
+    std::function<bool(face, face)> movable;
+    // edges around vertices with more than four faces in their order around the vertex, and saddles of every such edge
+    // together with the index of the edge in the saddle
+    std::vector<std::vector<std::pair<face, face>>> saddles;
+    std::map<std::pair<face, face>, std::vector<std::pair<int, int>>> saddles_of;
+    bool keepable(face a, face b, const std::pair<face, face> *removed = NULL) const;
+    void complete_tree();
     std::map<plane_position, std::vector<face>> plane;
     void dfs(face f);
     void try_unfold_dfs(face f, plane_position pos, face from, direction::direction from_directions);
-    void accumulate_dfs(face f, face from, std::map<face, std::set<face>> &t, std::vector<face> &acc);
+    void accumulate_dfs(face f, face from, const std::map<face, std::set<face>> &t, std::vector<face> &acc) const;
+    // versions working on given tree and plane, so that every thread can use its own buffers
+    int score(const std::map<face, std::set<face>> &t, const std::map<plane_position, std::vector<face>> &p) const;
+    void unfold(const std::map<face, std::set<face>> &t, std::map<plane_position, std::vector<face>> &p) const;
+    void unfold_dfs(const std::map<face, std::set<face>> &t, std::map<plane_position, std::vector<face>> &p, face f, plane_position pos, face from, direction::direction up_direction) const;
+    layout get_layout() const;
+    void prepare_cut(const layout &l, const cell_bitmap &all, cut_state &cut) const;
+    long long evaluate(const layout &l, const objective &obj, const swap_move &m, const cut_state &cut, move_effect &e) const;
 };
 
 // returns all reachable faces in vector acc
-void surface::accumulate_dfs(face f, face from, std::map<face, std::set<face>> &t, std::vector<face> &acc)
+void surface::accumulate_dfs(face f, face from, const std::map<face, std::set<face>> &t, std::vector<face> &acc) const
 {
     acc.push_back(f);
-    for (auto nb : t[f])
+    for (auto nb : t.at(f))
         if (nb != from)
             accumulate_dfs(nb, f, t, acc);
 }
@@ -263,6 +870,8 @@ bool surface::improve()
                 {
                     assert(!tree[f1].count(f2));
                     assert(!tree[f2].count(f1));
+                    if (!keepable(f1, f2))
+                        continue;
                     tree[f1].insert(f2);
                     tree[f2].insert(f1);
                     try_unfold();
@@ -288,8 +897,13 @@ bool surface::improve()
 // fives score to unfolding with overlaps
 int surface::score()
 {
-    int sc = 100 * plane.size();
-    for (auto pair : tree)
+    return score(tree, plane);
+}
+
+int surface::score(const std::map<face, std::set<face>> &t, const std::map<plane_position, std::vector<face>> &p) const
+{
+    int sc = 100 * p.size();
+    for (auto &&pair : t)
     {
         for (auto nb : pair.second)
         {
@@ -300,127 +914,1654 @@ int surface::score()
     return sc;
 }
 
-// creates unfolding from surface plane
-unfolding surface::get_bad_unfolding()
+// places faces of the current tree the same way as try_unfold
+layout surface::get_layout() const
 {
-    unfolding uf;
-    for (auto pair : plane)
+    layout l;
+    face start = tree.begin()->first;
+    l.add(start, {0, 0}, direction::up);
+    std::vector<std::pair<face, face>> stack = {{start, start}};
+    while (!stack.empty())
     {
-        if (pair.second.size() == 1)
+        face f = stack.back().first, from = stack.back().second;
+        stack.pop_back();
+        plane_position pos = l.placed[f].first;
+        direction::direction dir = l.placed[f].second;
+        for (auto neighbor : graph.at(f))
         {
-            if (pair.second[0].dir == direction_3d::up)
-                uf.squares[pair.first] = {pair.first, square_type::up};
-            if (pair.second[0].dir == direction_3d::down)
-                uf.squares[pair.first] = {pair.first, square_type::down};
-            if (pair.second[0].dir == direction_3d::left)
-                uf.squares[pair.first] = {pair.first, square_type::left};
-            if (pair.second[0].dir == direction_3d::right)
-                uf.squares[pair.first] = {pair.first, square_type::right};
-            if (pair.second[0].dir == direction_3d::front)
-                uf.squares[pair.first] = {pair.first, square_type::front};
-            if (pair.second[0].dir == direction_3d::back)
-                uf.squares[pair.first] = {pair.first, square_type::back};
+            if (from != neighbor && tree.at(f).count(neighbor))
+            {
+                const std::array<face, 4> &nb_ports = graph.at(neighbor);
+                direction::direction nb_dir = direction::up;
+                while (nb_ports[nb_dir] != f)
+                    nb_dir++;
+                l.add(neighbor, pos.neighbor(dir), (dir + 2) - nb_dir);
+                stack.push_back({neighbor, f});
+            }
+            dir++;
         }
-        else
-            uf.squares[pair.first] = {pair.first, square_type::overlap};
     }
-    return uf;
+    return l;
 }
 
-// dfs for unfolding surface with overlaps
-void surface::try_unfold_dfs(face f, plane_position pos, face from, direction::direction up_direction)
+long long surface::value(const objective &obj) const
 {
-    direction::direction dir = up_direction;
-    for (auto neighbor : graph[f])
-    {
-        if (from != neighbor && tree[f].count(neighbor))
-        {
-            plane[pos.neighbors()[dir]].push_back(neighbor);
-            direction::direction nb_dir = direction::up;
-            while (graph[neighbor][nb_dir] != f)
-                nb_dir++;
-            nb_dir = (dir + 2) - nb_dir;
-            try_unfold_dfs(neighbor, pos.neighbors()[dir], f, nb_dir);
-        }
-        dir++;
-    }
+    return obj.value(get_layout(), tree);
 }
 
-// unfolds surface given spanning tree with overlaps
-void surface::try_unfold()
+// rotates vector counterclockwise given number of times, up goes to left
+plane_position rotate(plane_position pos, int rotation)
 {
-    face start = tree.begin()->first;
-    plane.clear();
-
-    plane[{0, 0}].push_back(start);
-    try_unfold_dfs(start, {0, 0}, start, direction::up);
+    for (int r = 0; r < (rotation % 4 + 4) % 4; r++)
+        pos = {-pos.y, pos.x};
+    return pos;
 }
 
-// dfs for generating spanning tree
-void surface::dfs(face f)
+// removes cells occupied only by the moving part from the bitmap of the whole layout
+// and packs the cells of the moving part in all four rotations
+void surface::prepare_cut(const layout &l, const cell_bitmap &all, cut_state &cut) const
 {
-    std::vector<direction::direction> dirs = {direction::up, direction::left, direction::down, direction::right};
-    std::random_shuffle(dirs.begin(), dirs.end());
-    for (auto dir : dirs)
+    std::map<plane_position, int> moving_cells;
+    for (auto f : cut.moving)
+        moving_cells[l.placed.at(f).first]++;
+    std::vector<plane_position> cells, only;
+    cut.fixed_cells = l.cells.size();
+    for (auto &&pair : moving_cells)
     {
-        if (!tree.count(graph[f][dir]))
+        cells.push_back(pair.first);
+        if (l.cells.at(pair.first) == pair.second)
         {
-            tree[f].insert(graph[f][dir]);
-            tree[graph[f][dir]].insert(f);
-            dfs(graph[f][dir]);
+            only.push_back(pair.first);
+            cut.fixed_cells--;
         }
     }
+    cut.only_moving = cell_bitmap(only);
+    cut.moving_cells = cells.size();
+    for (int r = 0; r < 4; r++)
+    {
+        std::vector<plane_position> rotated;
+        for (auto pos : cells)
+            rotated.push_back(rotate(pos, r));
+        cut.rotations[r] = cell_bitmap(rotated);
+    }
+    cut.all = &all;
 }
 
-// generates spanning tree
-std::map<face, std::set<face>> surface::random_spanning_tree()
+// computes change of objective caused by the move without unfolding the whole tree
+// the moving part keeps its shape, it is only rotated and shifted so that it is attached by the new edge
+// its overlap with the fixed part is counted on bitmaps, the faces are placed only if the objective needs them
+long long surface::evaluate(const layout &l, const objective &obj, const swap_move &m, const cut_state &cut, move_effect &e) const
 {
-    tree.clear();
-    dfs(graph.begin()->first);
-    return tree;
-}
-
-// adds edge to the surface graph
+    face fixed = cut.moving_link_to ? m.link_from : m.link_to;
+    face attached = cut.moving_link_to ? m.link_to : m.link_from;
+    std::pair<plane_position, direction::direction> f = l.placed.at(fixed), a = l.placed.at(attached);
+    direction::direction dir = f.second, nb_dir = direction::up;
+    const std::array<face, 4> &ports = graph.at(fixed), &nb_ports = graph.at(attached);
+    while (ports[dir - f.second] != attached)
+        dir++;
+    while (nb_ports[nb_dir] != fixed)
+        nb_dir++;
+    plane_position pos = f.first.neighbor(dir);
+    int rotation = (((dir + 2) - nb_dir) - a.second + 4) % 4;
+    // new cell of a face is its old cell rotated around the origin and shifted by this vector
+    plane_position rotated = rotate(a.first, rotation);
+    plane_position shift = {pos.x - rotated.x, pos.y - rotated.y};
+    e.m = m;
+    e.moved.clear();
+    e.cells_after = -1;
+    if (obj.needs_moved())
+    {
+        for (auto g : cut.moving)
+        {
+            plane_position old = l.placed.at(g).first, moved = rotate(old, rotation);
+            e.moved.push_back({old, {moved.x + shift.x, moved.y + shift.y}});
+        }
+    }
+    else
+    {
+        // the fixed part is the whole layout without cells of the moving part alone
+        long long common = cut.all->overlap(cut.rotations[rotation], shift.x, shift.y) - cut.only_moving.overlap(cut.rotations[rotation], shift.x, shift.y);
+        e.cells_after = cut.fixed_cells + cut.moving_cells - common;
+    }
+    return obj.delta(l, e);
+}
+
+// evaluates whole neighborhood using given number of threads and applies the best move
+// ties are broken by the order of moves, so the result does not depend on the number of threads
+bool surface::improve_parallel(int threads, const objective &obj)
+{
+    std::vector<std::pair<face, face>> edges;
+    for (auto &&pair : tree)
+        for (auto nb : pair.second)
+            if (pair.first < nb && (!movable || movable(pair.first, nb)))
+                edges.push_back({pair.first, nb});
+    const layout l = get_layout();
+    std::vector<plane_position> cells;
+    for (auto &&pair : l.cells)
+        cells.push_back(pair.first);
+    // one bitmap read by all workers, every cut only knows which of its cells are not shared with the fixed part
+    const cell_bitmap all(cells);
+    // sizes of subtrees below the start of the layout, so that only the smaller part of every cut is visited
+    std::map<face, face> parent;
+    std::map<face, int> subtree;
+    std::vector<face> order = {tree.begin()->first};
+    parent[order[0]] = order[0];
+    for (int i = 0; i < (int)order.size(); i++)
+        for (auto nb : tree.at(order[i]))
+            if (nb != parent[order[i]])
+            {
+                parent[nb] = order[i];
+                order.push_back(nb);
+            }
+    for (int i = (int)order.size() - 1; i >= 0; i--)
+        if (++subtree[order[i]] && i)
+            subtree[parent[order[i]]] += subtree[order[i]];
+
+    // best improvement and index of the move (edge, position in its neighborhood) for every thread
+    struct candidate
+    {
+        long long delta;
+        int edge, index;
+        swap_move m;
+    };
+    std::vector<candidate> best(threads, {0, -1, -1, {}});
+    std::atomic<int> next_edge(0);
+    auto worker = [&](int id)
+    {
+        move_effect effect;
+        for (int e = next_edge++; e < (int)edges.size(); e = next_edge++)
+        {
+            face cut_from = edges[e].first, cut_to = edges[e].second;
+            // size of the part with cut_to
+            int size = parent.at(cut_to) == cut_from ? subtree.at(cut_to) : (int)order.size() - subtree.at(cut_from);
+            // layout does not matter up to rotation and shift, so the smaller part is moved
+            cut_state cut;
+            cut.moving_link_to = 2 * size <= (int)order.size();
+            if (cut.moving_link_to)
+                accumulate_dfs(cut_to, cut_from, tree, cut.moving);
+            else
+                accumulate_dfs(cut_from, cut_to, tree, cut.moving);
+            prepare_cut(l, all, cut);
+            std::set<face> moving(cut.moving.begin(), cut.moving.end());
+            std::pair<face, face> removed = edge_key(cut_from, cut_to);
+            int index = 0;
+            for (auto g : cut.moving)
+            {
+                for (auto h : graph.at(g))
+                {
+                    // link_from is in the part with cut_from
+                    face f1 = cut.moving_link_to ? h : g, f2 = cut.moving_link_to ? g : h;
+                    if (moving.count(h) || (f1 == cut_from && f2 == cut_to) || (movable && !movable(f1, f2)) || !keepable(f1, f2, &removed))
+                        continue;
+                    swap_move m = {cut_from, cut_to, f1, f2};
+                    long long d = evaluate(l, obj, m, cut, effect);
+                    // every thread takes edges in increasing order, so equal delta can only come from a later move
+                    if (d > best[id].delta)
+                        best[id] = {d, e, index, m};
+                    index++;
+                }
+            }
+        }
+    };
+    task_group group(scheduler());
+    for (int id = 1; id < threads; id++)
+        group.spawn([&worker, id]()
+                    { worker(id); });
+    worker(0);
+    group.wait();
+
+    candidate choice = best[0];
+    for (auto &&c : best)
+        if (c.edge >= 0 && (choice.edge < 0 || c.delta > choice.delta || (c.delta == choice.delta && std::make_pair(c.edge, c.index) < std::make_pair(choice.edge, choice.index))))
+            choice = c;
+    if (choice.edge < 0)
+        return false;
+    tree[choice.m.cut_from].erase(choice.m.cut_to);
+    tree[choice.m.cut_to].erase(choice.m.cut_from);
+    tree[choice.m.link_from].insert(choice.m.link_to);
+    tree[choice.m.link_to].insert(choice.m.link_from);
+    try_unfold();
+    return true;
+}
+
+// limits moves of improve_parallel to cutting and linking allowed edges, the rest of the tree stays as it is
+void surface::restrict_moves(const std::function<bool(face, face)> &allowed)
+{
+    movable = allowed;
+}
+
+// finds vertices with more than four faces around, four kept edges in a row around such vertex place five faces
+// around one point of the plane, so the first and the last of them always overlap
+// tree generation and the local search avoid such trees, returns the number of these vertices
+int surface::derive_constraints()
+{
+    saddles.clear();
+    saddles_of.clear();
+    // corner of face is given by the port, through which the walk around the vertex came to the face
+    std::set<std::pair<face, int>> seen;
+    for (auto &&pair : graph)
+    {
+        for (int corner = 0; corner < 4; corner++)
+        {
+            std::vector<std::pair<face, face>> around;
+            face f = pair.first;
+            int port = corner;
+            while (seen.insert({f, port}).second)
+            {
+                face g = graph.at(f)[(port + 1) % 4];
+                int back = 0;
+                while (graph.at(g)[back] != f)
+                    back++;
+                around.push_back(edge_key(f, g));
+                f = g;
+                port = back;
+            }
+            if (around.size() <= 4)
+                continue;
+            for (int i = 0; i < (int)around.size(); i++)
+                saddles_of[around[i]].push_back({(int)saddles.size(), i});
+            saddles.push_back(around);
+        }
+    }
+    return saddles.size();
+}
+
+// checks, whether the edge can join the tree without four kept edges in a row around some vertex, removed edge counts as cut
+bool surface::keepable(face a, face b, const std::pair<face, face> *removed) const
+{
+    auto it = saddles_of.find(edge_key(a, b));
+    if (it == saddles_of.end())
+        return true;
+    for (auto &&place : it->second)
+    {
+        const std::vector<std::pair<face, face>> &around = saddles[place.first];
+        int k = around.size(), i = place.second;
+        auto kept = [&](int j)
+        {
+            const std::pair<face, face> &e = around[(j % k + k) % k];
+            return !(removed && *removed == e) && tree.count(e.first) && tree.at(e.first).count(e.second);
+        };
+        int run = 1;
+        for (int j = 1; j < k && kept(i + j); j++)
+            run++;
+        for (int j = 1; j < k && kept(i - j); j++)
+            run++;
+        if (run >= 4)
+            return false;
+    }
+    return true;
+}
+
+// connects parts of the tree, that the constraints left apart, by keepable edges if possible and by any edges otherwise
+void surface::complete_tree()
+{
+    std::map<face, int> index;
+    for (auto &&pair : graph)
+    {
+        int i = index.size();
+        index[pair.first] = i;
+        tree[pair.first];
+    }
+    std::vector<int> parent(index.size());
+    for (int i = 0; i < (int)parent.size(); i++)
+        parent[i] = i;
+    std::function<int(int)> root = [&](int x)
+    {
+        return parent[x] == x ? x : parent[x] = root(parent[x]);
+    };
+    for (auto &&pair : tree)
+        for (auto nb : pair.second)
+            parent[root(index[pair.first])] = root(index[nb]);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (auto &&pair : graph)
+        {
+            for (auto nb : pair.second)
+            {
+                int a = root(index[pair.first]), b = root(index[nb]);
+                if (a == b || (!pass && !keepable(pair.first, nb)))
+                    continue;
+                parent[a] = b;
+                tree[pair.first].insert(nb);
+                tree[nb].insert(pair.first);
+            }
+        }
+    }
+}
+
+// creates unfolding from surface plane
+unfolding surface::get_bad_unfolding()
+{
+    unfolding uf;
+    for (auto pair : plane)
+    {
+        if (pair.second.size() == 1)
+        {
+            if (pair.second[0].dir == direction_3d::up)
+                uf.squares[pair.first] = {pair.first, square_type::up};
+            if (pair.second[0].dir == direction_3d::down)
+                uf.squares[pair.first] = {pair.first, square_type::down};
+            if (pair.second[0].dir == direction_3d::left)
+                uf.squares[pair.first] = {pair.first, square_type::left};
+            if (pair.second[0].dir == direction_3d::right)
+                uf.squares[pair.first] = {pair.first, square_type::right};
+            if (pair.second[0].dir == direction_3d::front)
+                uf.squares[pair.first] = {pair.first, square_type::front};
+            if (pair.second[0].dir == direction_3d::back)
+                uf.squares[pair.first] = {pair.first, square_type::back};
+        }
+        else
+            uf.squares[pair.first] = {pair.first, square_type::overlap};
+    }
+    return uf;
+}
+
+// dfs for unfolding surface with overlaps
+void surface::try_unfold_dfs(face f, plane_position pos, face from, direction::direction up_direction)
+{
+    unfold_dfs(tree, plane, f, pos, from, up_direction);
+}
+
+void surface::unfold_dfs(const std::map<face, std::set<face>> &t, std::map<plane_position, std::vector<face>> &p, face f, plane_position pos, face from, direction::direction up_direction) const
+{
+    const std::set<face> &children = t.at(f);
+    direction::direction dir = up_direction;
+    for (auto neighbor : graph.at(f))
+    {
+        if (from != neighbor && children.count(neighbor))
+        {
+            plane_position nb_pos = pos.neighbor(dir);
+            p[nb_pos].push_back(neighbor);
+            const std::array<face, 4> &nb_ports = graph.at(neighbor);
+            direction::direction nb_dir = direction::up;
+            while (nb_ports[nb_dir] != f)
+                nb_dir++;
+            nb_dir = (dir + 2) - nb_dir;
+            unfold_dfs(t, p, neighbor, nb_pos, f, nb_dir);
+        }
+        dir++;
+    }
+}
+
+// unfolds surface given spanning tree into given plane
+void surface::unfold(const std::map<face, std::set<face>> &t, std::map<plane_position, std::vector<face>> &p) const
+{
+    face start = t.begin()->first;
+    p.clear();
+    p[{0, 0}].push_back(start);
+    unfold_dfs(t, p, start, {0, 0}, start, direction::up);
+}
+
+// unfolds surface given spanning tree with overlaps
+void surface::try_unfold()
+{
+    unfold(tree, plane);
+}
+
+// dfs for generating spanning tree
+void surface::dfs(face f)
+{
+    std::array<direction::direction, 4> dirs = {direction::up, direction::left, direction::down, direction::right};
+    std::shuffle(dirs.begin(), dirs.end(), random_engine);
+    for (auto dir : dirs)
+    {
+        if (!tree.count(graph[f][dir]) && keepable(f, graph[f][dir]))
+        {
+            tree[f].insert(graph[f][dir]);
+            tree[graph[f][dir]].insert(f);
+            dfs(graph[f][dir]);
+        }
+    }
+}
+
+// generates spanning tree
+std::map<face, std::set<face>> surface::random_spanning_tree()
+{
+    tree.clear();
+    dfs(graph.begin()->first);
+    complete_tree();
+    return tree;
+}
+
+// generates spanning tree by bfs, that first grows the whole patch of faces with the same direction
+std::map<face, std::set<face>> surface::bands_spanning_tree()
+{
+    tree.clear();
+    face start = graph.begin()->first;
+    std::map<face, int> dist = {{start, 0}};
+    std::map<face, face> parent;
+    std::set<face> done;
+    // 0-1 bfs, edges between faces with the same direction are free
+    std::deque<face> queue = {start};
+    while (!queue.empty())
+    {
+        face f = queue.front();
+        queue.pop_front();
+        if (done.count(f))
+            continue;
+        done.insert(f);
+        if (f != start && keepable(f, parent[f]))
+        {
+            tree[f].insert(parent[f]);
+            tree[parent[f]].insert(f);
+        }
+        for (auto nb : graph[f])
+        {
+            int d = dist[f] + (nb.dir != f.dir);
+            if (done.count(nb) || (dist.count(nb) && dist[nb] <= d))
+                continue;
+            dist[nb] = d;
+            parent[nb] = f;
+            if (nb.dir == f.dir)
+                queue.push_front(nb);
+            else
+                queue.push_back(nb);
+        }
+    }
+    complete_tree();
+    return tree;
+}
+
+// generates spanning tree by kruskal's algorithm, edges with lower rank go first
+std::map<face, std::set<face>> surface::ranked_spanning_tree(const std::function<int(face, face)> &rank)
+{
+    tree.clear();
+    std::map<face, int> index;
+    std::vector<std::pair<int, std::pair<face, face>>> edges;
+    for (auto &&pair : graph)
+    {
+        int i = index.size();
+        index[pair.first] = i;
+        tree[pair.first];
+        for (auto nb : pair.second)
+            if (pair.first < nb)
+                edges.push_back({rank(pair.first, nb), {pair.first, nb}});
+    }
+    std::stable_sort(edges.begin(), edges.end(), [](const std::pair<int, std::pair<face, face>> &a, const std::pair<int, std::pair<face, face>> &b)
+                     { return a.first < b.first; });
+    std::vector<int> parent(index.size());
+    for (int i = 0; i < (int)parent.size(); i++)
+        parent[i] = i;
+    std::function<int(int)> root = [&](int x)
+    {
+        return parent[x] == x ? x : parent[x] = root(parent[x]);
+    };
+    for (auto &&e : edges)
+    {
+        int a = root(index[e.second.first]), b = root(index[e.second.second]);
+        if (a == b || !keepable(e.second.first, e.second.second))
+            continue;
+        parent[a] = b;
+        tree[e.second.first].insert(e.second.second);
+        tree[e.second.second].insert(e.second.first);
+    }
+    complete_tree();
+    return tree;
+}
+
+// generates spanning tree by prim's algorithm, that prefers faces landing on free cells of the plane
+// and then faces with the same direction as their parent
+std::map<face, std::set<face>> surface::greedy_spanning_tree()
+{
+    tree.clear();
+    plane.clear();
+    // position and up direction of every placed face, exactly as in try_unfold
+    std::map<face, std::pair<plane_position, direction::direction>> placed;
+    // (overlap, direction change, order), face and its parent
+    typedef std::pair<std::array<int, 3>, std::pair<face, face>> candidate;
+    std::priority_queue<candidate, std::vector<candidate>, std::greater<candidate>> queue;
+    int order = 0;
+    auto place = [&](face f, plane_position pos, direction::direction up_direction)
+    {
+        placed[f] = {pos, up_direction};
+        plane[pos].push_back(f);
+        direction::direction dir = up_direction;
+        for (auto nb : graph[f])
+        {
+            if (!placed.count(nb))
+                queue.push({{(int)plane.count(pos.neighbor(dir)), nb.dir != f.dir, order++}, {nb, f}});
+            dir++;
+        }
+    };
+    place(graph.begin()->first, {0, 0}, direction::up);
+    while (!queue.empty())
+    {
+        candidate c = queue.top();
+        queue.pop();
+        face f = c.second.first, from = c.second.second;
+        if (placed.count(f) || !keepable(from, f))
+            continue;
+        direction::direction dir = placed[from].second, nb_dir = direction::up;
+        while (graph[from][dir - placed[from].second] != f)
+            dir++;
+        plane_position pos = placed[from].first.neighbor(dir);
+        // the cell might have been taken since the candidate was queued
+        if (plane.count(pos) && !c.first[0])
+        {
+            c.first[0] = 1;
+            queue.push(c);
+            continue;
+        }
+        while (graph[f][nb_dir] != from)
+            nb_dir++;
+        tree[f].insert(from);
+        tree[from].insert(f);
+        place(f, pos, (dir + 2) - nb_dir);
+    }
+    complete_tree();
+    return tree;
+}
+
+// generates spanning tree by prim's algorithm like greedy_spanning_tree, but prefers cells in empty parts of the plane,
+// so that the unfolding spreads out instead of closing in on faces, that are not placed yet
+// a face without free cell can take the cell of a leaf, if the leaf has another free cell
+std::map<face, std::set<face>> surface::grown_spanning_tree(face start)
+{
+    tree.clear();
+    plane.clear();
+    std::map<face, std::pair<plane_position, direction::direction>> placed;
+    // (overlap, occupied cells around, direction change, random), face and its parent
+    typedef std::pair<std::array<int, 4>, std::pair<face, face>> candidate;
+    std::priority_queue<candidate, std::vector<candidate>, std::greater<candidate>> queue;
+    // position and up direction of face f attached to its placed neighbor from
+    auto attach = [&](face from, face f)
+    {
+        direction::direction dir = placed[from].second, nb_dir = direction::up;
+        while (graph[from][dir - placed[from].second] != f)
+            dir++;
+        while (graph[f][nb_dir] != from)
+            nb_dir++;
+        return std::make_pair(placed[from].first.neighbor(dir), (dir + 2) - nb_dir);
+    };
+    auto place = [&](face f, std::pair<plane_position, direction::direction> at)
+    {
+        placed[f] = at;
+        plane[at.first].push_back(f);
+        for (auto nb : graph[f])
+        {
+            if (placed.count(nb))
+                continue;
+            plane_position pos = attach(f, nb).first;
+            int around = 0;
+            for (int dx = -2; dx <= 2; dx++)
+                for (int dy = -2; dy <= 2; dy++)
+                    around += plane.count({pos.x + dx, pos.y + dy});
+            queue.push({{(int)plane.count(pos), around, nb.dir != f.dir, (int)(random_engine() >> 1)}, {nb, f}});
+        }
+    };
+    // finds a free cell for face f next to another placed neighbor or moves a leaf from one of its cells to another free cell,
+    // from becomes the neighbor of that cell
+    auto make_room = [&](face f, face &from)
+    {
+        for (auto nb : graph[f])
+        {
+            if (placed.count(nb) && !plane.count(attach(nb, f).first))
+            {
+                from = nb;
+                return true;
+            }
+        }
+        for (auto nb : graph[f])
+        {
+            if (!placed.count(nb))
+                continue;
+            plane_position pos = attach(nb, f).first;
+            face leaf = plane[pos][0];
+            if (plane[pos].size() != 1 || tree[leaf].size() != 1)
+                continue;
+            face parent = *tree[leaf].begin();
+            std::pair<face, face> removed = edge_key(leaf, parent);
+            for (auto other : graph[leaf])
+            {
+                if (other == parent || !placed.count(other) || plane.count(attach(other, leaf).first) || !keepable(other, leaf, &removed))
+                    continue;
+                tree[leaf].erase(parent);
+                tree[parent].erase(leaf);
+                tree[leaf].insert(other);
+                tree[other].insert(leaf);
+                plane.erase(pos);
+                placed[leaf] = attach(other, leaf);
+                plane[placed[leaf].first].push_back(leaf);
+                from = nb;
+                return true;
+            }
+        }
+        return false;
+    };
+    place(start, {{0, 0}, direction::up});
+    while (!queue.empty())
+    {
+        candidate c = queue.top();
+        queue.pop();
+        face f = c.second.first, from = c.second.second;
+        if (placed.count(f) || !keepable(from, f))
+            continue;
+        // the cell might have been taken since the candidate was queued
+        if (plane.count(attach(from, f).first) && !c.first[0])
+        {
+            c.first[0] = 1;
+            queue.push(c);
+            continue;
+        }
+        if (plane.count(attach(from, f).first))
+            make_room(f, from);
+        tree[f].insert(from);
+        tree[from].insert(f);
+        place(f, attach(from, f));
+    }
+    complete_tree();
+    return tree;
+}
+
+// unfolds the surface by growing spanning trees from evenly spread faces, stops at the first one without overlaps
+// returns false if all of them overlap, the tree with the least overlaps is kept then
+bool surface::grow_unfolding(int attempts)
+{
+    std::vector<face> faces;
+    for (auto &&pair : graph)
+        faces.push_back(pair.first);
+    std::map<face, std::set<face>> best;
+    size_t best_placed = 0;
+    for (int i = 0; i < attempts && best_placed != graph.size(); i++)
+    {
+        grown_spanning_tree(faces[(long long)i * faces.size() / attempts]);
+        try_unfold();
+        if (plane.size() > best_placed)
+        {
+            best_placed = plane.size();
+            best = tree;
+        }
+    }
+    tree = best;
+    try_unfold();
+    return best_placed == graph.size();
+}
+
+std::map<face, std::set<face>> surface::spanning_tree(start_strategy strategy)
+{
+    if (strategy == start_strategy::bands)
+        return bands_spanning_tree();
+    if (strategy == start_strategy::greedy)
+        return greedy_spanning_tree();
+    if (strategy == start_strategy::grown)
+    {
+        grow_unfolding();
+        return tree;
+    }
+    return random_spanning_tree();
+}
+
+// arithmetic for the elimination of laplacian, real numbers give the magnitude of the determinant
+struct real_field
+{
+    typedef double value;
+    value from(long long x) const { return x; }
+    value sub(value a, value b) const { return a - b; }
+    value mul(value a, value b) const { return a * b; }
+    value inverse(value a) const { return 1 / a; }
+};
+
+// residues modulo prime below 2^31, so that products fit into 64 bits
+struct modular_field
+{
+    typedef unsigned long long value;
+    unsigned long long p;
+    value from(long long x) const { return (x % (long long)p + p) % p; }
+    value sub(value a, value b) const { return (a + p - b) % p; }
+    value mul(value a, value b) const { return a * b % p; }
+    value inverse(value a) const
+    {
+        value result = 1;
+        for (unsigned long long e = p - 2; e; e >>= 1, a = mul(a, a))
+            if (e & 1)
+                result = mul(result, a);
+        return result;
+    }
+};
+
+// orders rows of symmetric matrix given by its off-diagonal pattern and coordinates of rows, so that the elimination
+// creates little fill, nested dissection halves the rows by the longest side of their bounding box and puts the rows
+// of the first half, that touch the second one, last
+std::vector<int> dissection_order(const std::vector<std::set<int>> &pattern, const std::vector<std::array<int, 3>> &coords)
+{
+    std::vector<int> order, side(pattern.size(), 0);
+    std::function<void(std::vector<int> &)> dissect = [&](std::vector<int> &part)
+    {
+        std::array<int, 3> low = coords[part[0]], high = coords[part[0]];
+        for (int v : part)
+            for (int i = 0; i < 3; i++)
+                low[i] = std::min(low[i], coords[v][i]), high[i] = std::max(high[i], coords[v][i]);
+        int axis = 0;
+        for (int i = 1; i < 3; i++)
+            if (high[i] - low[i] > high[axis] - low[axis])
+                axis = i;
+        int middle = (low[axis] + high[axis]) / 2;
+        if (part.size() <= 32 || low[axis] == high[axis])
+        {
+            order.insert(order.end(), part.begin(), part.end());
+            return;
+        }
+        std::vector<int> first, second, separator;
+        for (int v : part)
+            side[v] = coords[v][axis] <= middle ? 1 : 2;
+        for (int v : part)
+        {
+            bool touches = false;
+            for (int u : pattern[v])
+                touches |= side[v] == 1 && side[u] == 2;
+            (touches ? separator : side[v] == 1 ? first : second).push_back(v);
+        }
+        for (int v : part)
+            side[v] = 0;
+        part.clear();
+        part.shrink_to_fit();
+        if (!first.empty())
+            dissect(first);
+        if (!second.empty())
+            dissect(second);
+        order.insert(order.end(), separator.begin(), separator.end());
+    };
+    std::vector<int> all(pattern.size());
+    for (int v = 0; v < (int)all.size(); v++)
+        all[v] = v;
+    if (!all.empty())
+        dissect(all);
+    return order;
+}
+
+// gaussian elimination of symmetric sparse matrix in given order, returns false when some pivot is zero
+template <typename field>
+bool eliminate(const std::vector<std::map<int, long long>> &matrix, const std::vector<int> &order, const field &f, std::vector<typename field::value> &pivots)
+{
+    typedef typename field::value value;
+    std::vector<std::map<int, value>> rows(matrix.size());
+    for (int i = 0; i < (int)matrix.size(); i++)
+        for (auto &&entry : matrix[i])
+            rows[i][entry.first] = f.from(entry.second);
+    pivots.clear();
+    std::vector<std::pair<int, value>> row;
+    for (int v : order)
+    {
+        value pivot = rows[v][v];
+        if (pivot == value(0))
+            return false;
+        pivots.push_back(pivot);
+        value scale = f.inverse(pivot);
+        row.clear();
+        for (auto &&entry : rows[v])
+        {
+            if (entry.first == v)
+                continue;
+            row.push_back(entry);
+            rows[entry.first].erase(v);
+        }
+        for (auto &&a : row)
+        {
+            value x = f.mul(a.second, scale);
+            for (auto &&b : row)
+            {
+                value &target = rows[a.first][b.first];
+                target = f.sub(target, f.mul(x, b.second));
+            }
+        }
+        rows[v].clear();
+    }
+    return true;
+}
+
+bool is_prime(unsigned long long p)
+{
+    for (unsigned long long d = 2; d * d <= p; d++)
+        if (p % d == 0)
+            return false;
+    return p > 1;
+}
+
+// counts spanning trees by the matrix-tree theorem, it is the determinant of laplacian without the last row and column
+// the magnitude comes from the elimination in doubles, the exact digits from determinants modulo several primes joined by CRT
+spanning_tree_count surface::count_spanning_trees(int max_digits) const
+{
+    spanning_tree_count result;
+    std::map<face, int> index;
+    for (auto &&pair : graph)
+    {
+        int i = index.size();
+        index[pair.first] = i;
+    }
+    int m = (int)graph.size() - 1;
+    if (m <= 0)
+    {
+        result.exact = "1";
+        return result;
+    }
+    // disconnected graph has no spanning tree, its reduced laplacian is singular and every prime would fail
+    const spanning_tree_count zero = {-INFINITY, "0"};
+    std::vector<char> reached(m + 1, 0);
+    std::vector<face> stack = {graph.begin()->first};
+    reached[0] = 1;
+    int count = 1;
+    while (!stack.empty())
+    {
+        face f = stack.back();
+        stack.pop_back();
+        for (auto nb : graph.at(f))
+        {
+            char &seen = reached[index.at(nb)];
+            if (!seen)
+            {
+                seen = 1;
+                count++;
+                stack.push_back(nb);
+            }
+        }
+    }
+    if (count <= m)
+        return zero;
+    std::vector<std::map<int, long long>> laplacian(m);
+    std::vector<std::set<int>> pattern(m);
+    // doubled coordinates of centers of faces
+    std::vector<std::array<int, 3>> coords(m);
+    for (auto &&pair : graph)
+    {
+        int i = index[pair.first];
+        if (i == m)
+            continue;
+        const position &pos = pair.first.pos;
+        const int *offset = offsets_3d[pair.first.dir];
+        coords[i] = {2 * pos.x + offset[0], 2 * pos.y + offset[1], 2 * pos.z + offset[2]};
+        for (auto nb : pair.second)
+        {
+            int j = index.at(nb);
+            laplacian[i][i]++;
+            if (j == m)
+                continue;
+            laplacian[i][j]--;
+            pattern[i].insert(j);
+        }
+    }
+    std::vector<int> order = dissection_order(pattern, coords);
+
+    // the reduced laplacian of connected graph is positive definite, so all pivots are positive
+    std::vector<double> real_pivots;
+    if (!eliminate(laplacian, order, real_field(), real_pivots))
+        return zero;
+    for (double x : real_pivots)
+        result.log10 += std::log10(x);
+    int digits = (int)result.log10 + 1;
+    if (digits > max_digits)
+        return result;
+
+    // every prime has more than 9 digits, two more of them cover rounding of the magnitude
+    // a zero pivot modulo p only means that this prime is not usable, but after many such primes only the magnitude is known
+    std::vector<unsigned long long> primes, residues;
+    std::vector<unsigned long long> pivots;
+    int needed = digits / 9 + 2, failures = 0;
+    for (unsigned long long p = (1ULL << 31) - 1; (int)primes.size() < needed; p -= 2)
+    {
+        if (!is_prime(p))
+            continue;
+        modular_field f = {p};
+        if (!eliminate(laplacian, order, f, pivots))
+        {
+            if (++failures > needed + 16)
+                return result;
+            continue;
+        }
+        unsigned long long det = 1;
+        for (auto x : pivots)
+            det = f.mul(det, x);
+        primes.push_back(p);
+        residues.push_back(det);
+    }
+    // mixed radix digits by garner's algorithm, the count is c0 + p0 (c1 + p1 (c2 + ...))
+    int k = primes.size();
+    std::vector<unsigned long long> mixed(k);
+    for (int i = 0; i < k; i++)
+    {
+        modular_field f = {primes[i]};
+        unsigned long long value = 0, product = 1;
+        for (int j = 0; j < i; j++)
+        {
+            value = (value + f.mul(mixed[j], product)) % primes[i];
+            product = f.mul(product, primes[j] % primes[i]);
+        }
+        mixed[i] = f.mul(f.sub(residues[i], value), f.inverse(product));
+    }
+    // horner's scheme on number in base 10^9, least significant part first
+    std::vector<unsigned long long> number = {0};
+    for (int i = k - 1; i >= 0; i--)
+    {
+        unsigned long long carry = mixed[i];
+        for (auto &part : number)
+        {
+            unsigned long long x = part * primes[i] + carry;
+            part = x % 1000000000;
+            carry = x / 1000000000;
+        }
+        while (carry)
+        {
+            number.push_back(carry % 1000000000);
+            carry /= 1000000000;
+        }
+    }
+    while (number.size() > 1 && !number.back())
+        number.pop_back();
+    result.exact = std::to_string(number.back());
+    for (int i = (int)number.size() - 2; i >= 0; i--)
+    {
+        char buffer[10];
+        std::snprintf(buffer, sizeof(buffer), "%09llu", number[i]);
+        result.exact += buffer;
+    }
+    return result;
+}
+
+// packs cell into one number for hashing
+unsigned long long cell_key(plane_position pos)
+{
+    return (unsigned long long)(unsigned)pos.x << 32 | (unsigned)pos.y;
+}
+
+// part of the exhaustive search run by one task, the cut branch of a node near the root without the regions spawned
+// inside it, its nodes are consecutive in the sequential order and the regions come in the order of their paths
+struct search_region
+{
+    std::vector<bool> path;
+    std::atomic<long long> used{0};
+    // nodes visited before the first unfolding of the region, -1 if none was found
+    long long found_at = -1;
+    std::vector<std::pair<int, int>> edges;
+    // false if the search of the region stopped before its end
+    bool finished = false;
+};
+
+// state of one branch of the exhaustive search, a spawned branch keeps only its decisions,
+// the task running it replays the decisions from the root into its own state
+struct search_branch
+{
+    // cells of placed faces hashed by packed coordinates, a grid around the first face would be quadratic in the number of faces
+    std::unordered_set<unsigned long long> occupied;
+    std::vector<char> placed;
+    std::vector<plane_position> pos;
+    std::vector<direction::direction> up;
+    std::vector<std::array<char, 4>> cut;
+    std::vector<std::pair<int, int>> edges;
+    // decisions from the root, true for cut edges, so the sequential search visits branches in lexicographic order
+    std::vector<bool> path;
+    search_region *region = NULL;
+    // set when the budget, the deadline or an earlier unfolding stopped the search
+    bool stopped = false;
+};
+
+// searches all spanning trees for an unfolding without overlaps, every branch either keeps or cuts the edge between
+// a placed face and a face, that is not placed yet, the face with the fewest possibilities goes first
+// the found tree is kept, the search gives up after max_nodes branches or when it is cancelled
+// the cut branches near the root are regions run by tasks of any number of threads, the regions count their nodes
+// and the result is decided in their sequential order with the budget shared the same way as by the sequential search,
+// so only the deadline makes the result depend on timing
+search_result surface::exhaustive_unfolding(long long max_nodes, const cancel_token &cancel)
+{
+    std::vector<face> faces;
+    std::map<face, int> index;
+    for (auto &&pair : graph)
+    {
+        index[pair.first] = faces.size();
+        faces.push_back(pair.first);
+    }
+    int n = faces.size();
+    std::vector<std::array<int, 4>> nb(n);
+    for (int i = 0; i < n; i++)
+        for (int k = 0; k < 4; k++)
+            nb[i][k] = index.at(graph.at(faces[i])[k]);
+    std::atomic<bool> cancelled(false), any_found(false);
+    // regions are only added, the deque keeps their addresses
+    std::mutex regions_lock;
+    std::deque<search_region> regions;
+    // at most 2^6 regions
+    const int spawn_depth = 6;
+    task_group group(scheduler());
+    auto port = [&](int f, int g)
+    {
+        int k = 0;
+        while (nb[f][k] != g)
+            k++;
+        return k;
+    };
+    // whether some earlier region found an unfolding, then the sequential search never reaches this one
+    auto beaten = [&](const search_region &r)
+    {
+        if (!any_found)
+            return false;
+        std::lock_guard<std::mutex> guard(regions_lock);
+        for (auto &&q : regions)
+            if (q.found_at >= 0 && q.path < r.path)
+                return true;
+        return false;
+    };
+    // nodes of the earlier regions so far, the sequential search visits at least so many of them before this region
+    auto used_before = [&](const search_region &r)
+    {
+        long long used = 0;
+        std::lock_guard<std::mutex> guard(regions_lock);
+        for (auto &&q : regions)
+            if (q.path < r.path)
+                used += q.used;
+        return used;
+    };
+    auto add_region = [&](const std::vector<bool> &path)
+    {
+        std::lock_guard<std::mutex> guard(regions_lock);
+        regions.emplace_back();
+        regions.back().path = path;
+        return &regions.back();
+    };
+    auto start = [&](search_branch &b)
+    {
+        b.placed.assign(n, 0);
+        b.pos.resize(n);
+        b.up.assign(n, direction::up);
+        b.cut.assign(n, std::array<char, 4>{0, 0, 0, 0});
+        b.pos[0] = {0, 0};
+        b.placed[0] = 1;
+        b.occupied.insert(cell_key(b.pos[0]));
+    };
+    // finds the placed face and port of the next decision, returns false if some face can't be placed anymore
+    auto choose = [&](const search_branch &b, int &best_f, int &best_k)
+    {
+        int best_options = 5;
+        best_f = best_k = -1;
+        for (int g = 0; g < n; g++)
+        {
+            if (b.placed[g])
+                continue;
+            // options are the free cells next to placed neighbors and the neighbors, that are not placed yet
+            int options = 0, f = -1, k = -1;
+            for (int i = 0; i < 4; i++)
+            {
+                int h = nb[g][i];
+                if (b.cut[g][i] || (b.placed[h] && b.occupied.count(cell_key(b.pos[h].neighbor(b.up[h] + port(h, g))))))
+                    continue;
+                options++;
+                if (b.placed[h])
+                    f = h, k = port(h, g);
+            }
+            if (!options)
+                return false;
+            if (f >= 0 && options < best_options)
+                best_options = options, best_f = f, best_k = k;
+        }
+        return best_f >= 0;
+    };
+    // keeps the edge and places the face behind it, or undoes it
+    auto keep = [&](search_branch &b, int f, int k, bool value)
+    {
+        int g = nb[f][k], back = port(g, f);
+        if (value)
+        {
+            b.pos[g] = b.pos[f].neighbor(b.up[f] + k);
+            b.up[g] = (b.up[f] + k + 2) - back;
+            b.occupied.insert(cell_key(b.pos[g]));
+            b.edges.push_back({f, g});
+            b.path.push_back(false);
+        }
+        else
+        {
+            b.occupied.erase(cell_key(b.pos[g]));
+            b.edges.pop_back();
+            b.path.pop_back();
+        }
+        b.placed[g] = value;
+    };
+    // cuts the edge, or undoes it
+    auto cut = [&](search_branch &b, int f, int k, bool value)
+    {
+        int g = nb[f][k];
+        b.cut[f][k] = b.cut[g][port(g, f)] = value;
+        if (value)
+            b.path.push_back(true);
+        else
+            b.path.pop_back();
+    };
+    std::function<bool(search_branch &)> search = [&](search_branch &b)
+    {
+        search_region &r = *b.region;
+        if ((int)b.edges.size() == n - 1)
+        {
+            std::lock_guard<std::mutex> guard(regions_lock);
+            r.found_at = r.used;
+            r.edges = b.edges;
+            any_found = true;
+            return true;
+        }
+        // the sequential search would give up in this region, if the nodes before it and in it exceed the budget
+        long long used = ++r.used;
+        if (used % 1024 == 0 && cancel.cancelled())
+            cancelled = true;
+        b.stopped = used > max_nodes || cancelled || (used % 1024 == 0 && used + used_before(r) > max_nodes) || beaten(r);
+        if (b.stopped)
+            return false;
+        int f, k;
+        if (!choose(b, f, k))
+            return false;
+        // near the root the cut branch is a task, that other threads can steal
+        bool spawned = (int)b.path.size() < spawn_depth;
+        if (spawned)
+        {
+            std::vector<bool> path = b.path;
+            path.push_back(true);
+            search_region *region = add_region(path);
+            group.spawn([&, region]()
+                        {
+                            search_branch other;
+                            start(other);
+                            for (bool decision : region->path)
+                            {
+                                int next_f, next_k;
+                                choose(other, next_f, next_k);
+                                decision ? cut(other, next_f, next_k, true) : keep(other, next_f, next_k, true);
+                            }
+                            other.region = region;
+                            search(other);
+                            region->finished = !other.stopped; });
+        }
+        keep(b, f, k, true);
+        if (search(b))
+            return true;
+        keep(b, f, k, false);
+        if (spawned || b.stopped)
+            return false;
+        cut(b, f, k, true);
+        bool found = search(b);
+        cut(b, f, k, false);
+        return found;
+    };
+    search_branch root;
+    start(root);
+    root.region = add_region({});
+    search(root);
+    root.region->finished = !root.stopped;
+    group.wait();
+    // the budget is used by the regions in the sequential order, the first unfolding counts only if it fits
+    std::vector<const search_region *> order;
+    for (auto &&r : regions)
+        order.push_back(&r);
+    std::sort(order.begin(), order.end(), [](const search_region *a, const search_region *b)
+              { return a->path < b->path; });
+    long long used = 0;
+    const search_region *found = NULL;
+    bool gave_up = false;
+    for (auto r : order)
+    {
+        if (r->found_at >= 0)
+        {
+            found = used + r->found_at <= max_nodes ? r : NULL;
+            gave_up = !found;
+            break;
+        }
+        used += r->used;
+        if (!r->finished || used > max_nodes)
+        {
+            gave_up = true;
+            break;
+        }
+    }
+    if (!found)
+        return gave_up ? search_result::aborted : search_result::none;
+    tree.clear();
+    for (auto f : faces)
+        tree[f];
+    for (auto &&e : found->edges)
+    {
+        tree[faces[e.first]].insert(faces[e.second]);
+        tree[faces[e.second]].insert(faces[e.first]);
+    }
+    try_unfold();
+    return search_result::found;
+}
+
+// coarsens the surface into patches, that are connected faces with the same direction inside squares of side 2^level
+// the spanning tree connects every patch on every level, the search first cuts and links only the edges between
+// the coarsest patches, that are whole planar parts of the surface, then between finer patches around overlaps
+// returns true if the unfolding has no overlaps
+bool surface::multilevel_unfolding(int threads, const objective &obj, std::vector<level_report> &report, const cancel_token &cancel)
+{
+    std::map<face, int> index;
+    for (auto &&pair : graph)
+    {
+        int i = index.size();
+        index[pair.first] = i;
+    }
+    // coordinates of face in its plane, the third one is the position of the plane
+    // they are shifted to start at zero, so the squares of patches don't depend on the placement of the polycube
+    position min_pos = index.begin()->first.pos;
+    for (auto &&pair : index)
+        min_pos = {std::min(min_pos.x, pair.first.pos.x), std::min(min_pos.y, pair.first.pos.y), std::min(min_pos.z, pair.first.pos.z)};
+    std::vector<std::array<int, 3>> coords(index.size());
+    int extent = 1;
+    for (auto &&pair : index)
+    {
+        face f = pair.first;
+        int axis = f.dir / 2, c[3] = {f.pos.x - min_pos.x, f.pos.y - min_pos.y, f.pos.z - min_pos.z};
+        coords[pair.second] = {c[(axis + 1) % 3], c[(axis + 2) % 3], c[axis] + f.dir % 2};
+        for (int i = 0; i < 2; i++)
+            while (extent < coords[pair.second][i] + 1)
+                extent *= 2;
+    }
+    // the coarsest level has one square of side extent
+    int levels = 1;
+    while (1 << (levels - 1) < extent)
+        levels++;
+    // patch[level][face] is the representative face of its patch, level 0 has single faces
+    std::vector<std::vector<int>> patch(levels, std::vector<int>(index.size()));
+    for (int level = 0; level < levels; level++)
+    {
+        std::vector<int> &parent = patch[level];
+        for (int i = 0; i < (int)parent.size(); i++)
+            parent[i] = i;
+        std::function<int(int)> root = [&](int x)
+        {
+            return parent[x] == x ? x : parent[x] = root(parent[x]);
+        };
+        for (auto &&pair : graph)
+        {
+            int i = index[pair.first];
+            for (auto nb : pair.second)
+            {
+                int j = index[nb];
+                if (nb.dir == pair.first.dir && floor_div(coords[i][0], 1 << level) == floor_div(coords[j][0], 1 << level) && floor_div(coords[i][1], 1 << level) == floor_div(coords[j][1], 1 << level))
+                    parent[root(i)] = root(j);
+            }
+        }
+        for (int i = 0; i < (int)parent.size(); i++)
+            root(i);
+    }
+    // edges inside finer patches go first, so every patch is connected by the tree
+    ranked_spanning_tree([&](face a, face b)
+                         {
+                             int i = index[a], j = index[b], level = 0;
+                             while (level < levels && patch[level][i] != patch[level][j])
+                                 level++;
+                             return level; });
+    try_unfold();
+    report.clear();
+    for (int level = levels - 1; level >= 0; level--)
+    {
+        // patches with a face on overlapping cell, the coarsest level searches everywhere
+        std::set<int> touched;
+        for (auto &&pair : plane)
+            if (pair.second.size() > 1)
+                for (auto f : pair.second)
+                    touched.insert(patch[level][index[f]]);
+        if (level < levels - 1 && touched.empty())
+            break;
+        const std::vector<int> &p = patch[level];
+        bool everywhere = level == levels - 1;
+        restrict_moves([&](face a, face b)
+                       {
+                           int i = p[index.at(a)], j = p[index.at(b)];
+                           return i != j && (everywhere || touched.count(i) || touched.count(j)); });
+        level_report r = {level, 0, 0, 0};
+        for (int i = 0; i < (int)p.size(); i++)
+            r.patches += p[i] == i;
+        while (!cancel.cancelled() && improve_parallel(threads, obj))
+            r.rounds++;
+        for (auto &&pair : plane)
+            r.overlaps += pair.second.size() > 1;
+        report.push_back(r);
+    }
+    restrict_moves(nullptr);
+    return plane.size() == graph.size();
+}
+
+// adds edge to the surface graph
 void surface::connect(face f1, direction::direction d1, face f2, direction::direction d2)
 {
-    graph[f1][d1] = f2;
-    graph[f2][d2] = f1;
+    graph[f1][d1] = f2;
+    graph[f2][d2] = f1;
+}
+
+//generates svg output
+std::ostream &operator<<(std::ostream &os, unfolding &uf)
+{
+    int minx = 1e9, maxx = -1e9, miny = 1e9, maxy = -1e9;
+    for (auto pair : uf.squares)
+    {
+        minx = std::min(minx, pair.first.x);
+        miny = std::min(miny, pair.first.y);
+        maxy = std::max(maxy, pair.first.y);
+        maxx = std::max(maxx, pair.first.x);
+    }
+    int square_size = 100;
+    int margin = 20;
+    int height = (maxy - miny + 1) * square_size + 2 * margin;
+    int width = (maxx - minx + 1) * square_size + 2 * margin;
+    os << "<svg width=\"" << width << "\" height=\"" << height << "\">" << std::endl;
+    for (auto pair : uf.squares)
+    {
+        int x = square_size * (pair.first.x - minx) + margin;
+        int y = square_size * (maxy - pair.first.y) + margin;
+        os << "<rect x=\"" << x << "\" y=\"" << y << "\" width=\"" << square_size << "\" height=\"" << square_size << "\" style=\"" << square_style[pair.second.type] << "\"/>" << std::endl;
+    }
+    os << "</svg>" << std::endl;
+    return os;
+}
+
+// cube for one-layer polycubes
+struct plane_cube
+{
+    int index;
+    plane_position pos;
+    // in order: up, left, down, right
+    std::array<bool, 4> circumefence = {false, false, false, false};
+};
+
+// reverses order of bits in a word
+uint64_t reverse_bits(uint64_t x)
+{
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((x & 0x0f0f0f0f0f0f0f0fULL) << 4);
+    return __builtin_bswap64(x);
+}
+
+// one-layer polycube packed into rows of 64-bit words
+// the bounding box is extended by one empty cell on each side, so the exterior is connected
+class plane_bitboard
+{
+public:
+    // maximal run of hole cells in one row, columns [begin, end)
+    struct run
+    {
+        int row, begin, end, label;
+    };
+
+    int minx = 0, miny = 0, width = 0, height = 0, words = 0;
+    std::vector<uint64_t> cubes, exterior, holes;
+    std::vector<run> runs;
+    // runs[row_runs[r]] is the first run of row r
+    std::vector<int> row_runs;
+
+    plane_bitboard() {}
+    plane_bitboard(const std::map<plane_position, plane_cube> &cells);
+    bool empty() const { return !width; }
+    bool cube(plane_position pos) const { return test(cubes, pos); }
+    bool hole(plane_position pos) const { return test(holes, pos); }
+    bool outside(plane_position pos) const { return !inside(pos) || test(exterior, pos); }
+    int hole_label(plane_position pos) const;
+    long long hole_area() const { return popcount(holes); }
+    // labels holes and returns their number
+    int label_holes();
+    // hole cells without hole neighbors to the left and right, or up and down
+    std::vector<uint64_t> narrow_cells() const;
+    // hole cells without any hole neighbor
+    std::vector<uint64_t> single_cells() const;
+    // hole cells with at least three cube neighbors
+    std::vector<uint64_t> crowded_cells() const;
+    bool bit(const std::vector<uint64_t> &bits, plane_position pos) const { return test(bits, pos); }
+    static long long popcount(const std::vector<uint64_t> &bits);
+    static bool any(const std::vector<uint64_t> &bits) { return popcount(bits) > 0; }
+
+private:
+    bool inside(plane_position pos) const
+    {
+        return pos.x - minx + 1 >= 0 && pos.x - minx + 1 < width && pos.y - miny + 1 >= 0 && pos.y - miny + 1 < height;
+    }
+    bool test(const std::vector<uint64_t> &bits, plane_position pos) const
+    {
+        if (!inside(pos))
+            return false;
+        int col = pos.x - minx + 1;
+        return bits[(size_t)(pos.y - miny + 1) * words + col / 64] >> (col % 64) & 1;
+    }
+    void calculate_exterior();
+    void fill_runs(const uint64_t *free, uint64_t *seed) const;
+    void shift_row(const uint64_t *row, uint64_t *out, int shift) const;
+};
+
+plane_bitboard::plane_bitboard(const std::map<plane_position, plane_cube> &cells)
+{
+    if (cells.empty())
+        return;
+    int maxx = -1e9, maxy = -1e9;
+    minx = miny = 1e9;
+    for (auto &&pair : cells)
+    {
+        minx = std::min(minx, pair.first.x);
+        miny = std::min(miny, pair.first.y);
+        maxx = std::max(maxx, pair.first.x);
+        maxy = std::max(maxy, pair.first.y);
+    }
+    width = maxx - minx + 3;
+    height = maxy - miny + 3;
+    words = (width + 63) / 64;
+    cubes.assign((size_t)words * height, 0);
+    for (auto &&pair : cells)
+    {
+        int col = pair.first.x - minx + 1;
+        cubes[(size_t)(pair.first.y - miny + 1) * words + col / 64] |= 1ULL << (col % 64);
+    }
+    calculate_exterior();
+    holes.assign(cubes.size(), 0);
+    uint64_t last_mask = width % 64 ? (1ULL << (width % 64)) - 1 : ~0ULL;
+    for (size_t i = 0; i < holes.size(); i++)
+        holes[i] = ~cubes[i] & ~exterior[i] & ((int)(i % words) == words - 1 ? last_mask : ~0ULL);
+}
+
+long long plane_bitboard::popcount(const std::vector<uint64_t> &bits)
+{
+    long long count = 0;
+    for (auto word : bits)
+        count += __builtin_popcountll(word);
+    return count;
+}
+
+// shifts row by one column, positive shift moves bits to higher columns
+void plane_bitboard::shift_row(const uint64_t *row, uint64_t *out, int shift) const
+{
+    for (int i = 0; i < words; i++)
+    {
+        if (shift > 0)
+            out[i] = row[i] << 1 | (i ? row[i - 1] >> 63 : 0);
+        else
+            out[i] = row[i] >> 1 | (i + 1 < words ? row[i + 1] << 63 : 0);
+    }
+}
+
+// extends seeds to the whole runs of free cells containing them
+void plane_bitboard::fill_runs(const uint64_t *free, uint64_t *seed) const
+{
+    // adding seeds to the free cells carries through the run above every seed
+    uint64_t carry = 0;
+    for (int i = 0; i < words; i++)
+    {
+        uint64_t x = seed[i] & free[i];
+        uint64_t sum = free[i] + x;
+        uint64_t c = sum < free[i];
+        sum += carry;
+        carry = c | (sum < carry);
+        seed[i] = ((sum ^ free[i]) & free[i]) | x;
+    }
+    // the same in reversed order fills the parts below the seeds
+    carry = 0;
+    for (int i = words - 1; i >= 0; i--)
+    {
+        uint64_t f = reverse_bits(free[i]);
+        uint64_t x = reverse_bits(seed[i]);
+        uint64_t sum = f + x;
+        uint64_t c = sum < f;
+        sum += carry;
+        carry = c | (sum < carry);
+        seed[i] |= reverse_bits((sum ^ f) & f);
+    }
+}
+
+// flood fill from the border of the bounding box, alternating downward and upward sweeps
+void plane_bitboard::calculate_exterior()
+{
+    std::vector<uint64_t> free(cubes.size());
+    uint64_t last_mask = width % 64 ? (1ULL << (width % 64)) - 1 : ~0ULL;
+    for (size_t i = 0; i < free.size(); i++)
+        free[i] = ~cubes[i] & ((int)(i % words) == words - 1 ? last_mask : ~0ULL);
+    exterior.assign(cubes.size(), 0);
+    for (int r = 0; r < height; r++)
+    {
+        exterior[(size_t)r * words] |= 1;
+        exterior[(size_t)r * words + (width - 1) / 64] |= 1ULL << ((width - 1) % 64);
+    }
+    for (int i = 0; i < words; i++)
+    {
+        exterior[i] = free[i];
+        exterior[(size_t)(height - 1) * words + i] = free[(size_t)(height - 1) * words + i];
+    }
+    std::vector<uint64_t> row(words);
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (int k = 1; k < height; k++)
+            {
+                int r = pass ? height - 1 - k : k;
+                int prev = pass ? r + 1 : r - 1;
+                uint64_t *ext = &exterior[(size_t)r * words];
+                for (int i = 0; i < words; i++)
+                    row[i] = ext[i] | (exterior[(size_t)prev * words + i] & free[(size_t)r * words + i]);
+                fill_runs(&free[(size_t)r * words], row.data());
+                for (int i = 0; i < words; i++)
+                {
+                    changed |= row[i] != ext[i];
+                    ext[i] = row[i];
+                }
+            }
+        }
+    }
+}
+
+// connected component labeling of hole runs, runs overlapping in neighboring rows are merged
+int plane_bitboard::label_holes()
+{
+    runs.clear();
+    row_runs.assign(height + 1, 0);
+    for (int r = 0; r < height; r++)
+    {
+        row_runs[r] = runs.size();
+        const uint64_t *row = &holes[(size_t)r * words];
+        int col = 0;
+        while (col < width)
+        {
+            // skip to the next hole cell, then to the end of its run
+            int i = col / 64;
+            uint64_t word = row[i] & (~0ULL << (col % 64));
+            while (!word && ++i < words)
+                word = row[i];
+            if (i >= words)
+                break;
+            int begin = i * 64 + __builtin_ctzll(word);
+            word = ~row[i] & (~0ULL << (begin % 64));
+            while (!word && ++i < words)
+                word = ~row[i];
+            int end = i >= words ? width : i * 64 + __builtin_ctzll(word);
+            runs.push_back({r, begin, end, (int)runs.size()});
+            col = end;
+        }
+    }
+    row_runs[height] = runs.size();
+
+    std::vector<int> parent(runs.size());
+    for (int i = 0; i < (int)runs.size(); i++)
+        parent[i] = i;
+    auto find = [&](int x)
+    {
+        while (parent[x] != x)
+            x = parent[x] = parent[parent[x]];
+        return x;
+    };
+    for (int r = 1; r < height; r++)
+    {
+        int i = row_runs[r - 1], j = row_runs[r];
+        while (i < row_runs[r] && j < row_runs[r + 1])
+        {
+            if (runs[i].begin < runs[j].end && runs[j].begin < runs[i].end)
+                parent[find(i)] = find(j);
+            if (runs[i].end < runs[j].end)
+                i++;
+            else
+                j++;
+        }
+    }
+    int count = 0;
+    std::vector<int> label(runs.size(), -1);
+    for (int i = 0; i < (int)runs.size(); i++)
+    {
+        int root = find(i);
+        if (label[root] < 0)
+            label[root] = count++;
+        runs[i].label = label[root];
+    }
+    return count;
 }
 
-//generates svg output
-std::ostream &operator<<(std::ostream &os, unfolding &uf)
+// returns index of hole containing given position, -1 if it is not a hole
+int plane_bitboard::hole_label(plane_position pos) const
 {
-    int minx = 1e9, maxx = -1e9, miny = 1e9, maxy = -1e9;
-    for (auto pair : uf.squares)
+    if (!hole(pos))
+        return -1;
+    int r = pos.y - miny + 1, col = pos.x - minx + 1;
+    auto it = std::upper_bound(runs.begin() + row_runs[r], runs.begin() + row_runs[r + 1], col,
+                               [](int c, const run &rn)
+                               { return c < rn.end; });
+    return it->label;
+}
+
+std::vector<uint64_t> plane_bitboard::narrow_cells() const
+{
+    std::vector<uint64_t> narrow(holes.size(), 0), left(words), right(words);
+    for (int r = 1; r + 1 < height; r++)
     {
-        minx = std::min(minx, pair.first.x);
-        miny = std::min(miny, pair.first.y);
-        maxy = std::max(maxy, pair.first.y);
-        maxx = std::max(maxx, pair.first.x);
+        const uint64_t *row = &holes[(size_t)r * words];
+        shift_row(row, left.data(), 1);
+        shift_row(row, right.data(), -1);
+        for (int i = 0; i < words; i++)
+        {
+            uint64_t vertical = ~holes[(size_t)(r - 1) * words + i] & ~holes[(size_t)(r + 1) * words + i];
+            narrow[(size_t)r * words + i] = row[i] & ((~left[i] & ~right[i]) | vertical);
+        }
     }
-    int square_size = 100;
-    int margin = 20;
-    int height = (maxy - miny + 1) * square_size + 2 * margin;
-    int width = (maxx - minx + 1) * square_size + 2 * margin;
-    os << "<svg width=\"" << width << "\" height=\"" << height << "\">" << std::endl;
-    for (auto pair : uf.squares)
+    return narrow;
+}
+
+std::vector<uint64_t> plane_bitboard::single_cells() const
+{
+    std::vector<uint64_t> single(holes.size(), 0), left(words), right(words);
+    for (int r = 1; r + 1 < height; r++)
     {
-        int x = square_size * (pair.first.x - minx) + margin;
-        int y = square_size * (maxy - pair.first.y) + margin;
-        os << "<rect x=\"" << x << "\" y=\"" << y << "\" width=\"" << square_size << "\" height=\"" << square_size << "\" style=\"" << square_style[pair.second.type] << "\"/>" << std::endl;
+        const uint64_t *row = &holes[(size_t)r * words];
+        shift_row(row, left.data(), 1);
+        shift_row(row, right.data(), -1);
+        for (int i = 0; i < words; i++)
+            single[(size_t)r * words + i] = row[i] & ~left[i] & ~right[i] & ~holes[(size_t)(r - 1) * words + i] & ~holes[(size_t)(r + 1) * words + i];
     }
-    os << "</svg>" << std::endl;
-    return os;
+    return single;
 }
 
-// cube for one-layer polycubes
-struct plane_cube
+std::vector<uint64_t> plane_bitboard::crowded_cells() const
 {
-    int index;
-    plane_position pos;
-    // in order: up, left, down, right
-    std::vector<bool> circumefence = {false, false, false, false};
-};
+    std::vector<uint64_t> crowded(holes.size(), 0), left(words), right(words);
+    for (int r = 1; r + 1 < height; r++)
+    {
+        const uint64_t *row = &holes[(size_t)r * words];
+        shift_row(row, left.data(), 1);
+        shift_row(row, right.data(), -1);
+        for (int i = 0; i < words; i++)
+        {
+            // neighbors of hole cells, that are not holes, are cubes
+            uint64_t lc = ~left[i], rc = ~right[i], uc = ~holes[(size_t)(r + 1) * words + i], dc = ~holes[(size_t)(r - 1) * words + i];
+            crowded[(size_t)r * words + i] = row[i] & ((lc & rc & (uc | dc)) | (uc & dc & (lc | rc)));
+        }
+    }
+    return crowded;
+}
 
 // class representing one-layer polycubes
 class plane_polycube
@@ -428,20 +2569,21 @@ class plane_polycube
 public:
     int n;
     int h = 0;
-    std::vector<std::set<plane_position>> holes;
-    std::set<plane_position> hole_cubes;
     std::map<plane_position, plane_cube> cubes;
+    plane_bitboard board;
     std::vector<std::pair<plane_position, direction::direction>> circumference;
     void caluclate_circumference();
     void calculate_holes();
     bool big_holes();
+    bool flap_holes();
+    std::set<plane_position> problem_hole_cells();
     unfolding unfold_no_holes();
     unfolding unfold_big_holes();
     unfolding unfold_1x1();
     unfolding unfold_orthotree();
 
 private:
-    void hole_dfs(plane_position pos, int hole_index);
+    void build_board();
     void stripe(plane_position head, plane_position uf_head, direction::direction dir, direction::direction uf_dir, unfolding &uf);
     int degree(plane_position pos);
 };
@@ -451,7 +2593,7 @@ int plane_polycube::degree(plane_position pos)
 {
     int deg = 0;
     for (auto neighbor : pos.neighbors())
-        deg += cubes.count(neighbor);
+        deg += board.cube(neighbor);
     return deg;
 }
 
@@ -478,7 +2620,7 @@ unfolding plane_polycube::unfold_orthotree()
                 uf.squares[to_uf[{pair.first, dir}].up()] = {to_uf[{pair.first, dir}].up(), square_type::top_base};
                 uf.squares[to_uf[{pair.first, dir}].down()] = {to_uf[{pair.first, dir}].down(), square_type::bottom_base};
                 // if the left neighbor has degree 4, we unfold it together with this square
-                if (cubes.count(pair.first.left()) && degree(pair.first.left()) == 4)
+                if (board.cube(pair.first.left()) && degree(pair.first.left()) == 4)
                 {
                     uf.squares[to_uf[{pair.first, dir}].up().left()] = {to_uf[{pair.first, dir}].up().left(), square_type::top_base};
                     uf.squares[to_uf[{pair.first, dir}].down().left()] = {to_uf[{pair.first, dir}].down().left(), square_type::bottom_base};
@@ -495,43 +2637,43 @@ void plane_polycube::stripe(plane_position head, plane_position uf_head, directi
 {
     int orientation = uf_dir == direction::up ? -1 : 1;
     square_type st = uf_dir == direction::up ? square_type::top_base : square_type::bottom_base;
-    plane_position other_head = head.neighbors()[dir - 1];
-    plane_position other_uf_head = uf_head.neighbors()[uf_dir + orientation];
+    plane_position other_head = head.neighbor(dir - 1);
+    plane_position other_uf_head = uf_head.neighbor(uf_dir + orientation);
 
-    if (cubes.count(head.neighbors()[dir + 2]) || cubes.count(other_head.neighbors()[dir + 2]))
+    if (board.cube(head.neighbor(dir + 2)) || board.cube(other_head.neighbor(dir + 2)))
         return;
 
-    while (cubes.count(head) || cubes.count(other_head))
+    while (board.cube(head) || board.cube(other_head))
     {
 
         // the shifts and rotaions are a bit confusing
         // TODO: check this
-        if (cubes.count(head))
+        if (board.cube(head))
             uf.squares[uf_head] = {uf_head, st};
-        else if (hole_cubes.count(head))
+        else if (board.hole(head))
             uf.squares[uf_head] = {uf_head, square_type::hole};
 
-        if (cubes.count(other_head))
+        if (board.cube(other_head))
             uf.squares[other_uf_head] = {other_uf_head, st};
-        else if (hole_cubes.count(other_head))
+        else if (board.hole(other_head))
             uf.squares[other_uf_head] = {other_uf_head, square_type::hole};
 
-        if (hole_cubes.count(head.neighbors()[dir + 1]))
-            uf.squares[uf_head.neighbors()[uf_dir - orientation]] = {uf_head.neighbors()[uf_dir - orientation], square_type::hole};
-        if (hole_cubes.count(other_head.neighbors()[dir - 1]))
-            uf.squares[other_uf_head.neighbors()[uf_dir + orientation]] = {other_uf_head.neighbors()[uf_dir + orientation], square_type::hole};
+        if (board.hole(head.neighbor(dir + 1)))
+            uf.squares[uf_head.neighbor(uf_dir - orientation)] = {uf_head.neighbor(uf_dir - orientation), square_type::hole};
+        if (board.hole(other_head.neighbor(dir - 1)))
+            uf.squares[other_uf_head.neighbor(uf_dir + orientation)] = {other_uf_head.neighbor(uf_dir + orientation), square_type::hole};
 
-        head = head.neighbors()[dir];
-        other_head = other_head.neighbors()[dir];
-        uf_head = uf_head.neighbors()[uf_dir];
-        other_uf_head = other_uf_head.neighbors()[uf_dir];
+        head = head.neighbor(dir);
+        other_head = other_head.neighbor(dir);
+        uf_head = uf_head.neighbor(uf_dir);
+        other_uf_head = other_uf_head.neighbor(uf_dir);
     }
 }
 
 // unfolds one-layer polyhedra with 1x1 holes
 unfolding plane_polycube::unfold_1x1()
 {
-    assert(h == (int)hole_cubes.size());
+    assert(h == board.hole_area());
     unfolding uf;
     plane_position uf_pos = {0, 0};
     // we go around the circumcircle and start stripes in correct places and directions
@@ -544,22 +2686,22 @@ unfolding plane_polycube::unfold_1x1()
         // the places and directions are quite messy, there might be some mistake
         if (dir == direction::left && (pos.y % 4 + 4) % 4 == 0)
             stripe(pos.up(), uf_pos.up().left(), direction::right, direction::up, uf);
-        if (dir == direction::left && (pos.y % 4 + 4) % 4 == 1 && !cubes.count(pos.down()))
+        if (dir == direction::left && (pos.y % 4 + 4) % 4 == 1 && !board.cube(pos.down()))
             stripe(pos, uf_pos.up(), direction::right, direction::up, uf);
 
         if (dir == direction::right && (pos.y % 4 + 4) % 4 == 2)
             stripe(pos, uf_pos.up(), direction::left, direction::up, uf);
-        if (dir == direction::right && (pos.y % 4 + 4) % 4 == 3 && !cubes.count(pos.down()))
+        if (dir == direction::right && (pos.y % 4 + 4) % 4 == 3 && !board.cube(pos.down()))
             stripe(pos.down(), uf_pos.up().left(), direction::left, direction::up, uf);
 
         if (dir == direction::up && (pos.x % 4 + 4) % 4 == 1)
             stripe(pos, uf_pos.down(), direction::down, direction::down, uf);
-        if (dir == direction::up && (pos.x % 4 + 4) % 4 == 0 && !cubes.count(pos.right()))
+        if (dir == direction::up && (pos.x % 4 + 4) % 4 == 0 && !board.cube(pos.right()))
             stripe(pos.right(), uf_pos.down().left(), direction::down, direction::down, uf);
 
         if (dir == direction::down && (pos.x % 4 + 4) % 4 == 2)
             stripe(pos, uf_pos.down(), direction::up, direction::down, uf);
-        if (dir == direction::down && (pos.x % 4 + 4) % 4 == 3 && !cubes.count(pos.left()))
+        if (dir == direction::down && (pos.x % 4 + 4) % 4 == 3 && !board.cube(pos.left()))
             stripe(pos.left(), uf_pos.down().left(), direction::up, direction::down, uf);
     }
     return uf;
@@ -577,17 +2719,33 @@ std::ostream &operator<<(std::ostream &os, plane_polycube &pl_pc)
 // checkes, whether there is one-wide gap in some of the holes
 bool plane_polycube::big_holes()
 {
-    for (auto pos : hole_cubes)
-    {
-        if (!hole_cubes.count(pos.left()) && !hole_cubes.count(pos.right()))
-            return false;
-        if (!hole_cubes.count(pos.up()) && !hole_cubes.count(pos.down()))
-            return false;
-    }
-    return true;
+    return !plane_bitboard::any(board.narrow_cells());
+}
+
+// checkes, whether walls of every hole fit into its top and bottom part, that is no hole cell has three cube neighbors
+bool plane_polycube::flap_holes()
+{
+    return !plane_bitboard::any(board.crowded_cells());
 }
 
-// unfolds one-layer polycube with big holes
+// returns cells of holes, where some cell is enclosed from three sides, that touch some cube
+std::set<plane_position> plane_polycube::problem_hole_cells()
+{
+    std::vector<uint64_t> crowded = board.crowded_cells();
+    std::set<int> labels;
+    for (auto &&pair : cubes)
+        for (auto pos : pair.first.neighbors())
+            if (board.bit(crowded, pos))
+                labels.insert(board.hole_label(pos));
+    std::set<plane_position> cells;
+    for (auto &&pair : cubes)
+        for (auto pos : pair.first.neighbors())
+            if (labels.count(board.hole_label(pos)))
+                cells.insert(pos);
+    return cells;
+}
+
+// unfolds one-layer polycube with big holes, one-wide gaps are allowed as long as flap_holes holds
 unfolding plane_polycube::unfold_big_holes()
 {
     assert(n > 0);
@@ -605,18 +2763,31 @@ unfolding plane_polycube::unfold_big_holes()
     {
         uf.squares[pair.first] = {pair.first, square_type::top_base};
         // unfold left and right parts of hole
-        if (!cubes[pair.first].circumefence[direction::left] && !cubes.count(pair.first.left()))
+        if (!cubes[pair.first].circumefence[direction::left] && !board.cube(pair.first.left()))
             uf.squares[pair.first.left()] = {pair.first.left(), square_type::hole};
-        if (!cubes[pair.first].circumefence[direction::right] && !cubes.count(pair.first.right()))
-            uf.squares[pair.first.right()] = {pair.first.right(), square_type::hole};
-
         pos = {pair.first.x, 2 * min_pos.y - pair.first.y - 2};
-        // unfold top and bottom parts of hole
+        // in one-wide gap the left part is already there, so the right one goes to the bottom
+        bool right_gap = board.cube(pair.first.right().right());
+        if (!cubes[pair.first].circumefence[direction::right] && !board.cube(pair.first.right()))
+        {
+            if (right_gap)
+                uf.squares[pos.right()] = {pos.right(), square_type::hole};
+            else
+                uf.squares[pair.first.right()] = {pair.first.right(), square_type::hole};
+        }
+
+        // unfold top and bottom parts of hole, the same way the bottom part of one-wide gap goes to the top
         uf.squares[pos] = {pos, square_type::bottom_base};
-        if (!cubes[pair.first].circumefence[direction::up] && !cubes.count(pair.first.up()))
+        bool down_gap = board.cube(pair.first.down().down());
+        if (!cubes[pair.first].circumefence[direction::up] && !board.cube(pair.first.up()))
             uf.squares[pos.down()] = {pos.down(), square_type::hole};
-        if (!cubes[pair.first].circumefence[direction::down] && !cubes.count(pair.first.down()))
-            uf.squares[pos.up()] = {pos.up(), square_type::hole};
+        if (!cubes[pair.first].circumefence[direction::down] && !board.cube(pair.first.down()))
+        {
+            if (down_gap)
+                uf.squares[pair.first.down()] = {pair.first.down(), square_type::hole};
+            else
+                uf.squares[pos.up()] = {pos.up(), square_type::hole};
+        }
     }
     return uf;
 }
@@ -645,34 +2816,18 @@ unfolding plane_polycube::unfold_no_holes()
     return uf;
 }
 
-// dfs searching for holes
-void plane_polycube::hole_dfs(plane_position pos, int hole_index)
+// packs the cubes into bitboard, all other queries use it instead of the map
+void plane_polycube::build_board()
 {
-    if (holes[hole_index].count(pos) || cubes.count(pos))
-        return;
-    holes[hole_index].insert(pos);
-    hole_cubes.insert(pos);
-    for (auto neighbor : pos.neighbors())
-        hole_dfs(neighbor, hole_index);
+    if (board.empty())
+        board = plane_bitboard(cubes);
 }
 
-// finds all holes and saves them into appripriate sets
+// finds and labels all holes, hole cells are the empty cells not reachable from outside of the bounding box
 void plane_polycube::calculate_holes()
 {
-    for (auto &&pair : cubes)
-    {
-        direction::direction dir = direction::up;
-        do
-        {
-            plane_position neighbor = pair.first.neighbors()[dir];
-            if (!cubes.count(neighbor) && !pair.second.circumefence[dir] && !hole_cubes.count(neighbor))
-            {
-                holes.push_back({});
-                hole_dfs(neighbor, h++);
-            }
-            dir++;
-        } while (dir != direction::up);
-    }
+    build_board();
+    h = board.label_holes();
 }
 
 // calculates direction of circumference for every cube
@@ -680,6 +2835,7 @@ void plane_polycube::caluclate_circumference()
 {
     // start with the lowest cube of the leftmost column
     assert(n);
+    build_board();
     circumference.clear();
     plane_position start = cubes.begin()->first;
     direction::direction dir = direction::left;
@@ -698,19 +2854,19 @@ void plane_polycube::caluclate_circumference()
     // continue untill we return to the starting point
     while (first || pos != start)
     {
-        while (!cubes.count(pos.neighbors()[dir]))
+        while (!board.cube(pos.neighbor(dir)))
         {
             cubes[pos].circumefence[dir] = true;
             circumference.push_back({pos, dir++});
         }
         // find the next cube and direction
-        pos = pos.neighbors()[dir--];
-        if (cubes.count(pos.neighbors()[dir]))
-            pos = pos.neighbors()[dir--];
+        pos = pos.neighbor(dir--);
+        if (board.cube(pos.neighbor(dir)))
+            pos = pos.neighbor(dir--);
         first = false;
     }
     // finish the rest of the first cube
-    while (!cubes.count(pos.neighbors()[dir]))
+    while (!board.cube(pos.neighbor(dir)))
     {
         if (dir == direction::left)
             break;
@@ -719,22 +2875,56 @@ void plane_polycube::caluclate_circumference()
     }
 }
 
+// structural properties of polycube, all computed in a single pass over the cubes
+struct polycube_analysis
+{
+    bool connected = true;
+    // connected and without cycles of face-adjacent cubes
+    bool orthotree = true;
+    int components = 0;
+    // 0 for multi-layer polycube, otherwise index of the planar axis
+    int axis = 1;
+    position min_pos = {0, 0, 0}, max_pos = {0, 0, 0};
+    long long adjacencies = 0;
+    long long surface_faces = 0;
+    // V - E + F - C of the cubical complex, the surface has twice this characteristic
+    long long euler = 0;
+    // lattice edges with two diagonal cubes and lattice vertices, where the surface is not a disk
+    long long singular_edges = 0, singular_vertices = 0;
+    // connected parts of the surface, every cavity adds one
+    long long surface_components = 0;
+    // genus of the surface, sum over its parts, meaningful only without singular edges and vertices
+    long long genus = 0;
+};
+
+// summary of loading coordinates from a file
+struct load_report
+{
+    long long lines = 0, duplicates = 0;
+    // line number and byte offset of every malformed line
+    std::vector<std::pair<long long, long long>> malformed;
+};
+
 // main class for polycube
 class polycube
 {
 public:
     int n;
     std::map<position, cube> cubes;
+    const polycube_analysis &analyze(int threads = 1);
+    bool load(const char *path, int threads, load_report &report);
     bool connected();
     bool polyhedron();
     int one_layer();
     plane_polycube to_one_layer();
     bool orthotree();
-    surface get_surface();
+    surface get_surface(bool constraints = false);
 
 private:
-    int dfs(position pos);
-    bool ortho_dfs(position pos, position from);
+    // the analysis is cached until the cubes are loaded again
+    bool analyzed = false;
+    polycube_analysis analysis;
+    friend std::istream &operator>>(std::istream &is, polycube &pc);
     void connect_on_cube(position pos, surface &surf);
     void connect_face_neighbors(position pos, surface &surf);
     void connect_edge_neighbors(position pos, surface &surf);
@@ -851,7 +3041,8 @@ void polycube::connect_edge_neighbors(position pos, surface &surf)
     }
 }
 
-surface polycube::get_surface()
+// the saddle constraints are derived only on request, without them every edge is keepable
+surface polycube::get_surface(bool constraints)
 {
     surface surf;
     for (auto pair : cubes)
@@ -861,135 +3052,873 @@ surface polycube::get_surface()
         connect_face_neighbors(pos, surf);
         connect_edge_neighbors(pos, surf);
     }
+    if (constraints)
+        surf.derive_constraints();
     return surf;
 }
 
-// returns false if there is a cycle
-bool polycube::ortho_dfs(position pos, position from)
+// returs true iff the polycube is orthotree
+bool polycube::orthotree()
 {
-    if (!cubes.count(pos))
-        return true;
-    if (cubes[pos].visited)
+    return analyze().orthotree;
+}
+
+// deletes one of coordinates from position
+plane_position from_position(position pos, int axis)
+{
+    assert(axis >= 1 && axis <= 3);
+    if (axis == 1)
+        return {pos.y, pos.z};
+    else if (axis == 2)
+        return {pos.x, pos.z};
+    return {pos.x, pos.y};
+}
+
+// creates one-layer polycube from polycube (basically just deletes one of the coordinates)
+plane_polycube polycube::to_one_layer()
+{
+    plane_polycube pl_pc;
+    pl_pc.n = n;
+    int axis = analyze().axis;
+    assert(axis);
+    for (auto pair : cubes)
+    {
+        plane_cube pl_c;
+        pl_c.index = pair.second.index;
+        plane_position pos = from_position(pair.first, axis);
+        pl_c.pos = pos;
+        pl_pc.cubes[pos] = pl_c;
+    }
+    return pl_pc;
+}
+
+// returns 0 in case of multi-layer polycube, otherwise returns index representing the planar axis
+int polycube::one_layer()
+{
+    return analyze().axis;
+}
+
+// returns true iff the polycube is connected
+bool polycube::connected()
+{
+    return analyze().connected;
+}
+
+// finds root in union-find shared by more threads, compresses paths by halving
+int find_root(std::vector<std::atomic<int>> &parent, int x)
+{
+    while (true)
+    {
+        int p = parent[x].load();
+        if (p == x)
+            return x;
+        int gp = parent[p].load();
+        if (gp != p)
+            parent[x].compare_exchange_weak(p, gp);
+        x = gp;
+    }
+}
+
+// joins two sets, the root with larger index is always attached, so no cycle can appear
+void unite(std::vector<std::atomic<int>> &parent, int a, int b)
+{
+    while (true)
+    {
+        a = find_root(parent, a);
+        b = find_root(parent, b);
+        if (a == b)
+            return;
+        if (a < b)
+            std::swap(a, b);
+        int expected = a;
+        if (parent[a].compare_exchange_strong(expected, b))
+            return;
+    }
+}
+
+// whether the surface around lattice vertex with given occupied octants is a disk
+// octants are indexed by bits x, y, z, both the occupied and the empty ones have to be connected through faces
+bool manifold_vertex(int mask)
+{
+    static const std::array<bool, 256> table = []()
+    {
+        std::array<bool, 256> t;
+        for (int m = 0; m < 256; m++)
+        {
+            bool ok = true;
+            for (int part : {m, ~m & 255})
+            {
+                if (!part)
+                    continue;
+                int reached = part & -part;
+                for (int step = 0; step < 3; step++)
+                    for (int o = 0; o < 8; o++)
+                        if (reached >> o & 1)
+                            for (int bit : {1, 2, 4})
+                                reached |= (part >> (o ^ bit) & 1) << (o ^ bit);
+                ok &= reached == part;
+            }
+            t[m] = ok;
+        }
+        return t;
+    }();
+    return table[mask];
+}
+
+// computes connectivity, cycles, layers, bounding box, surface and euler characteristic at once
+// every thread takes a range of cubes, counts what it owns and joins components in shared union-find
+const polycube_analysis &polycube::analyze(int threads)
+{
+    if (analyzed)
+        return analysis;
+    analysis = polycube_analysis();
+    std::vector<position> cells;
+    cells.reserve(cubes.size());
+    for (auto &&pair : cubes)
+        cells.push_back(pair.first);
+    int count = cells.size();
+    analyzed = true;
+    if (!count)
+        return analysis;
+
+    // cells are sorted, so the lookups do not need the map
+    auto index = [&](position pos)
+    {
+        auto it = std::lower_bound(cells.begin(), cells.end(), pos);
+        return it != cells.end() && *it == pos ? int(it - cells.begin()) : -1;
+    };
+    std::vector<std::atomic<int>> parent(count);
+    for (int i = 0; i < count; i++)
+        parent[i] = i;
+    // faces of cubes are 6 * cube + direction, surface faces meeting at a lattice edge are joined
+    std::vector<std::atomic<int>> face_parent(6LL * count);
+    for (int i = 0; i < 6 * count; i++)
+        face_parent[i] = i;
+
+    struct partial
+    {
+        position min_pos, max_pos;
+        long long adjacencies = 0, vertices = 0, edges = 0, singular_edges = 0, singular_vertices = 0;
+    };
+    threads = std::max(1, std::min(threads, count / 1024 + 1));
+    std::vector<partial> parts(threads);
+    auto worker = [&](int id)
+    {
+        partial &part = parts[id];
+        part.min_pos = part.max_pos = cells[(long long)count * id / threads];
+        for (int i = (long long)count * id / threads; i < (long long)count * (id + 1) / threads; i++)
+        {
+            position pos = cells[i];
+            part.min_pos = {std::min(part.min_pos.x, pos.x), std::min(part.min_pos.y, pos.y), std::min(part.min_pos.z, pos.z)};
+            part.max_pos = {std::max(part.max_pos.x, pos.x), std::max(part.max_pos.y, pos.y), std::max(part.max_pos.z, pos.z)};
+            // right, up and back neighbors, so that every adjacency is seen once
+            for (int dir : {direction_3d::right, direction_3d::up, direction_3d::back})
+            {
+                int j = index(pos.neighbor(dir));
+                if (j >= 0)
+                {
+                    part.adjacencies++;
+                    unite(parent, i, j);
+                }
+            }
+            // lattice vertex belongs to the first cube around it in lexicographic order
+            // the cube itself is in the octant corner, the owner also classifies the vertex
+            for (int corner = 0; corner < 8; corner++)
+            {
+                position vertex = {pos.x + (corner >> 2 & 1), pos.y + (corner >> 1 & 1), pos.z + (corner & 1)};
+                int mask = 0;
+                for (int o = 0; o < 8; o++)
+                    mask |= (index({vertex.x - (o >> 2 & 1), vertex.y - (o >> 1 & 1), vertex.z - (o & 1)}) >= 0) << o;
+                if (mask >> (corner + 1))
+                    continue;
+                part.vertices++;
+                part.singular_vertices += !manifold_vertex(mask);
+            }
+            // the same for lattice edges, along every axis there are four of them
+            for (int axis = 0; axis < 3; axis++)
+            {
+                for (int corner = 0; corner < 4; corner++)
+                {
+                    int d[3] = {0, 0, 0};
+                    d[(axis + 1) % 3] = corner >> 1 & 1;
+                    d[(axis + 2) % 3] = corner & 1;
+                    int mask = 0, around[4];
+                    for (int other = 0; other < 4; other++)
+                    {
+                        int e[3] = {0, 0, 0};
+                        e[(axis + 1) % 3] = d[(axis + 1) % 3] - (other >> 1 & 1);
+                        e[(axis + 2) % 3] = d[(axis + 2) % 3] - (other & 1);
+                        around[other] = index({pos.x + e[0], pos.y + e[1], pos.z + e[2]});
+                        mask |= (around[other] >= 0) << other;
+                    }
+                    if (mask >> (corner + 1))
+                        continue;
+                    part.edges++;
+                    // two cubes touching only along the edge
+                    part.singular_edges += mask == 6 || mask == 9;
+                    // faces of the cubes around the edge, that contain it and look into empty cell
+                    int first = -1;
+                    for (int other = 0; other < 4; other++)
+                    {
+                        if (around[other] < 0)
+                            continue;
+                        int u = other >> 1 & 1, v = other & 1;
+                        int faces[2][2] = {{2 * ((axis + 1) % 3) + u, (1 - u) << 1 | v}, {2 * ((axis + 2) % 3) + v, u << 1 | (1 - v)}};
+                        for (auto &&f : faces)
+                        {
+                            if (mask >> f[1] & 1)
+                                continue;
+                            if (first < 0)
+                                first = 6 * around[other] + f[0];
+                            else
+                                unite(face_parent, first, 6 * around[other] + f[0]);
+                        }
+                    }
+                }
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int id = 1; id < threads; id++)
+        workers.emplace_back(worker, id);
+    worker(0);
+    for (auto &&w : workers)
+        w.join();
+
+    long long vertices = 0, edges = 0;
+    analysis.min_pos = parts[0].min_pos;
+    analysis.max_pos = parts[0].max_pos;
+    for (auto &&part : parts)
+    {
+        analysis.adjacencies += part.adjacencies;
+        vertices += part.vertices;
+        edges += part.edges;
+        analysis.singular_edges += part.singular_edges;
+        analysis.singular_vertices += part.singular_vertices;
+        analysis.min_pos = {std::min(analysis.min_pos.x, part.min_pos.x), std::min(analysis.min_pos.y, part.min_pos.y), std::min(analysis.min_pos.z, part.min_pos.z)};
+        analysis.max_pos = {std::max(analysis.max_pos.x, part.max_pos.x), std::max(analysis.max_pos.y, part.max_pos.y), std::max(analysis.max_pos.z, part.max_pos.z)};
+    }
+    for (int i = 0; i < count; i++)
+    {
+        analysis.components += find_root(parent, i) == i;
+        for (int dir = 0; dir < 6; dir++)
+            analysis.surface_components += find_root(face_parent, 6 * i + dir) == 6 * i + dir && index(cells[i].neighbor(dir)) < 0;
+    }
+    analysis.connected = analysis.components == 1;
+    analysis.orthotree = analysis.connected && analysis.adjacencies == count - 1;
+    analysis.axis = analysis.min_pos.x == analysis.max_pos.x   ? 1
+                    : analysis.min_pos.y == analysis.max_pos.y ? 2
+                    : analysis.min_pos.z == analysis.max_pos.z ? 3
+                                                               : 0;
+    analysis.surface_faces = 6LL * count - 2 * analysis.adjacencies;
+    analysis.euler = vertices - edges + (6LL * count - analysis.adjacencies) - count;
+    // every part of the surface has characteristic 2 - 2g and bounds the polycube together with the others
+    analysis.genus = analysis.surface_components - analysis.euler;
+    return analysis;
+}
+
+// reads triplets of coordinates till the EOF
+std::istream &operator>>(std::istream &is, polycube &pc)
+{
+    position pos;
+    cube c;
+    pc.n = 0;
+    pc.analyzed = false;
+    while (is >> pos.x >> pos.y >> pos.z)
+    {
+        // duplicate coordinates are skipped
+        if (pc.cubes.count(pos))
+            continue;
+        c.pos = pos;
+        c.index = pc.n++;
+        pc.cubes[pos] = c;
+    }
+    return is;
+}
+
+// parses lines of one chunk, positions are returned together with their order in the chunk
+// line numbers of malformed lines are relative to the chunk
+void parse_chunk(const char *begin, const char *end, long long offset, std::vector<std::pair<position, int>> &cells, long long &lines, std::vector<std::pair<long long, long long>> &malformed)
+{
+    const char *line = begin;
+    lines = 0;
+    while (line < end)
+    {
+        const char *line_end = std::find(line, end, '\n');
+        const char *p = line;
+        auto skip_spaces = [&]()
+        {
+            while (p < line_end && (*p == ' ' || *p == '\t' || *p == '\r'))
+                p++;
+        };
+        skip_spaces();
+        if (p < line_end)
+        {
+            int coords[3];
+            bool ok = true;
+            for (int i = 0; i < 3 && ok; i++)
+            {
+                skip_spaces();
+                auto result = std::from_chars(p, line_end, coords[i]);
+                ok = result.ec == std::errc();
+                p = result.ptr;
+            }
+            skip_spaces();
+            if (ok && p == line_end)
+                cells.push_back({{coords[0], coords[1], coords[2]}, (int)cells.size()});
+            else
+                malformed.push_back({lines, offset + (line - begin)});
+        }
+        lines++;
+        line = line_end + 1;
+    }
+    std::sort(cells.begin(), cells.end());
+}
+
+// loads coordinates from file, the file is mapped to memory, split into chunks at line boundaries
+// and the chunks are parsed by more threads, duplicate coordinates are counted and skipped
+// pipes and other files, that can't be mapped, are read into memory first
+bool polycube::load(const char *path, int threads, load_report &report)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
         return false;
-    cubes[pos].visited = true;
-    for (auto neighbor : pos.neighbors())
-        if (neighbor != from && !ortho_dfs(neighbor, pos))
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    const char *data = NULL;
+    bool mapped_file = S_ISREG(st.st_mode);
+    std::string buffer;
+    if (!mapped_file)
+    {
+        char block[1 << 16];
+        ssize_t length;
+        while ((length = read(fd, block, sizeof(block))) > 0)
+            buffer.append(block, length);
+        close(fd);
+        if (length < 0)
             return false;
+        size = buffer.size();
+        data = buffer.data();
+    }
+    else if (size)
+    {
+        void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED)
+            return false;
+        data = static_cast<const char *>(mapped);
+        madvise(mapped, size, MADV_SEQUENTIAL);
+    }
+    else
+        close(fd);
+
+    // chunk boundaries are moved behind the nearest newline
+    threads = std::max(1, (int)std::min<size_t>(threads, size / (1 << 16) + 1));
+    std::vector<size_t> bounds = {0};
+    for (int i = 1; i < threads; i++)
+    {
+        size_t b = std::max(bounds.back(), size * i / threads);
+        while (b < size && data[b - 1] != '\n')
+            b++;
+        bounds.push_back(b);
+    }
+    bounds.push_back(size);
+
+    std::vector<std::vector<std::pair<position, int>>> cells(threads);
+    std::vector<std::vector<std::pair<long long, long long>>> malformed(threads);
+    std::vector<long long> lines(threads);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; i++)
+        workers.emplace_back(parse_chunk, data + bounds[i], data + bounds[i + 1], bounds[i], std::ref(cells[i]), std::ref(lines[i]), std::ref(malformed[i]));
+    parse_chunk(data, data + bounds[1], 0, cells[0], lines[0], malformed[0]);
+    for (auto &&w : workers)
+        w.join();
+    if (mapped_file && size)
+        munmap(const_cast<char *>(data), size);
+
+    report = load_report();
+    std::vector<int> first_index(threads + 1, 0);
+    for (int i = 0; i < threads; i++)
+    {
+        for (auto &&m : malformed[i])
+            report.malformed.push_back({report.lines + m.first + 1, m.second});
+        report.lines += lines[i];
+        first_index[i + 1] = first_index[i] + cells[i].size();
+    }
+
+    // chunks are sorted, k-way merge gives sorted sequence, so duplicates are neighbors
+    // and the map can be filled by insertions at its end
+    // equal positions are ordered by index in the whole file, so the first occurrence is kept for any chunking
+    cubes.clear();
+    n = 0;
+    analyzed = false;
+    typedef std::pair<std::pair<position, int>, int> head;
+    std::priority_queue<head, std::vector<head>, std::greater<head>> queue;
+    std::vector<size_t> next(threads, 0);
+    for (int i = 0; i < threads; i++)
+        if (!cells[i].empty())
+            queue.push({{cells[i][0].first, first_index[i] + cells[i][0].second}, i});
+    while (!queue.empty())
+    {
+        head top = queue.top();
+        queue.pop();
+        int chunk = top.second;
+        if (++next[chunk] < cells[chunk].size())
+            queue.push({{cells[chunk][next[chunk]].first, first_index[chunk] + cells[chunk][next[chunk]].second}, chunk});
+        position pos = top.first.first;
+        if (!cubes.empty() && std::prev(cubes.end())->first == pos)
+        {
+            report.duplicates++;
+            continue;
+        }
+        cube c;
+        c.pos = pos;
+        c.index = top.first.second;
+        cubes.emplace_hint(cubes.end(), pos, c);
+        n++;
+    }
+    // indices of skipped duplicates leave gaps, the cubes are numbered again in the order of the file
+    std::vector<std::pair<int, cube *>> order;
+    order.reserve(n);
+    for (auto &&pair : cubes)
+        order.push_back({pair.second.index, &pair.second});
+    std::sort(order.begin(), order.end());
+    for (int i = 0; i < (int)order.size(); i++)
+        order[i].second->index = i;
     return true;
 }
 
-// returs true iff the polycube is orthotree
-bool polycube::orthotree()
+// checks, whether the polycube is a polyhedron (connected, without cavities and its surface is a 2-manifold)
+bool polycube::polyhedron()
+{
+    const polycube_analysis &a = analyze();
+    return a.connected && !a.singular_edges && !a.singular_vertices && a.surface_components == 1;
+}
+
+// command line options
+struct options
+{
+    // number of threads evaluating the neighborhood, 0 means the original first-improvement search
+    int threads = 0;
+    unsigned seed = std::time(NULL);
+    std::vector<start_strategy> starts = {start_strategy::random};
+    // file with coordinates, standard input is read if empty
+    std::string input;
+    // name of objective of the local search, the others than classic always use improve_parallel
+    std::string goal = "classic";
+    // file with list of polycube files, processed in batch divided into shards
+    std::string corpus, output;
+    int shard = 0, shards = 1;
+    // shard result files to merge
+    std::vector<std::string> merge;
+    // search of general polycubes, auto is exhaustive only when the number of spanning trees is small
+    // and multilevel for large surfaces
+    std::string search = "auto";
+    // seconds of search for every shape, 0 for no limit, the token of the current shape is made from it
+    double deadline = 0;
+    std::shared_ptr<cancel_token> cancel = std::make_shared<cancel_token>();
+    bool scheduler_stats = false;
+    // runs the regression checks instead of unfolding
+    bool self_test = false;
+    // trees keep at most three edges in a row around vertices with more than four faces
+    bool saddle_constraints = false;
+};
+
+// creates objective given by its name, returns null for unknown names
+std::unique_ptr<objective> make_objective(const std::string &name)
+{
+    if (name == "classic")
+        return std::unique_ptr<objective>(new classic_objective());
+    if (name == "overlaps")
+        return std::unique_ptr<objective>(new overlap_objective());
+    if (name == "bbox")
+        return std::unique_ptr<objective>(new bounding_box_objective());
+    if (name == "folds")
+        return std::unique_ptr<objective>(new fold_objective());
+    return NULL;
+}
+
+const std::map<std::string, start_strategy> start_names = {
+    {"random", start_strategy::random},
+    {"bands", start_strategy::bands},
+    {"greedy", start_strategy::greedy},
+    {"grown", start_strategy::grown},
+};
+
+// parses command line, returns false for unknown arguments and for a shard without corpus
+bool parse_options(int argc, char **argv, options &opt)
 {
-    for (auto pair : cubes)
-        cubes[pair.first].visited = false;
-    if (!n)
-        return true;
-    return ortho_dfs(cubes.begin()->first, cubes.begin()->first);
+    bool sharded = false;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+            opt.threads = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--input" && i + 1 < argc)
+            opt.input = argv[++i];
+        else if (arg == "--corpus" && i + 1 < argc)
+            opt.corpus = argv[++i];
+        else if (arg == "--output" && i + 1 < argc)
+            opt.output = argv[++i];
+        else if (arg == "--shard" && i + 1 < argc)
+        {
+            if (std::sscanf(argv[++i], "%d/%d", &opt.shard, &opt.shards) != 2 || opt.shards < 1 || opt.shard < 0 || opt.shard >= opt.shards)
+                return false;
+            sharded = true;
+        }
+        else if (arg == "--merge" && i + 1 < argc)
+        {
+            opt.merge.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        else if (arg == "--objective" && i + 1 < argc && make_objective(argv[i + 1]))
+            opt.goal = argv[++i];
+        else if (arg == "--search" && i + 1 < argc && (std::string(argv[i + 1]) == "auto" || std::string(argv[i + 1]) == "exhaustive" || std::string(argv[i + 1]) == "heuristic" || std::string(argv[i + 1]) == "multilevel"))
+            opt.search = argv[++i];
+        else if (arg == "--deadline" && i + 1 < argc)
+            opt.deadline = std::atof(argv[++i]);
+        else if (arg == "--scheduler-stats")
+            opt.scheduler_stats = true;
+        else if (arg == "--self-test")
+            opt.self_test = true;
+        else if (arg == "--saddle-constraints")
+            opt.saddle_constraints = true;
+        else if (arg == "--seed" && i + 1 < argc)
+            opt.seed = std::strtoul(argv[++i], NULL, 10);
+        else if (arg == "--start" && i + 1 < argc && std::string(argv[i + 1]) == "compare")
+        {
+            // runs all strategies and reports, how many rounds each of them needed
+            opt.starts.clear();
+            for (auto &&pair : start_names)
+                opt.starts.push_back(pair.second);
+            i++;
+        }
+        else if (arg == "--start" && i + 1 < argc && start_names.count(argv[i + 1]))
+            opt.starts = {start_names.at(argv[++i])};
+        else
+            return false;
+    }
+    return !sharded || !opt.corpus.empty();
 }
 
-// deletes one of coordinates from position
-plane_position from_position(position pos, int axis)
+// unfolds general polycube by local search over spanning trees of its surface
+// with more starting strategies, the one with the best final value is returned
+unfolding unfold_heuristically(polycube &pc, const options &opt)
 {
-    assert(axis >= 1 && axis <= 3);
-    if (axis == 1)
-        return {pos.y, pos.z};
-    else if (axis == 2)
-        return {pos.x, pos.z};
-    return {pos.x, pos.y};
+    surface base = pc.get_surface(opt.saddle_constraints);
+    std::unique_ptr<objective> obj = make_objective(opt.goal);
+    bool parallel = opt.threads || opt.goal != "classic";
+    if (base.saddle_count())
+        std::cerr << base.saddle_count() << " vertices have more than four faces, spanning trees keep at most three edges in a row around them." << std::endl;
+    unfolding best;
+    long long best_value = 0;
+    bool first = true;
+    std::map<std::string, int> rounds_needed;
+    for (auto strategy : opt.starts)
+    {
+        std::string name;
+        for (auto &&pair : start_names)
+            if (pair.second == strategy)
+                name = pair.first;
+        random_engine.seed(opt.seed);
+        surface surf = base;
+        {
+            allocation_stage stage("spanning tree");
+            surf.spanning_tree(strategy);
+            surf.try_unfold();
+        }
+        long long initial = surf.value(*obj);
+        std::cerr << "Unfolding using heuristics from " << name << " spanning tree..." << std::endl;
+        int rounds = 0;
+        allocation_stage stage("local search");
+        while (!opt.cancel->cancelled() && (parallel ? surf.improve_parallel(std::max(1, opt.threads), *obj) : surf.improve()))
+            rounds++;
+        long long final_value = surf.value(*obj);
+        std::cerr << "Done after " << rounds << " improvements, " << opt.goal << " objective " << initial << " -> " << final_value << "." << std::endl;
+        rounds_needed[name] = rounds;
+        if (first || final_value > best_value)
+        {
+            first = false;
+            best_value = final_value;
+            best = surf.get_bad_unfolding();
+        }
+    }
+    if (rounds_needed.size() > 1 && rounds_needed.count("random"))
+        for (auto &&pair : rounds_needed)
+            if (pair.first != "random")
+                std::cerr << "Start " << pair.first << " saves " << rounds_needed["random"] - pair.second << " improvements compared to random." << std::endl;
+    return best;
 }
 
-// creates one-layer polycube from polycube (basically just deletes one of the coordinates)
-plane_polycube polycube::to_one_layer()
+// unfolds large surface by the multilevel search over planar patches, returns false if overlaps remain
+bool unfold_multilevel(polycube &pc, const options &opt, unfolding &uf)
 {
-    plane_polycube pl_pc;
-    pl_pc.n = n;
-    int axis = one_layer();
-    assert(axis);
-    for (auto pair : cubes)
+    surface surf = pc.get_surface(opt.saddle_constraints);
+    std::unique_ptr<objective> obj = make_objective(opt.goal);
+    std::vector<level_report> report;
+    bool unfolded;
     {
-        plane_cube pl_c;
-        pl_c.index = pair.second.index;
-        plane_position pos = from_position(pair.first, axis);
-        pl_c.pos = pos;
-        pl_pc.cubes[pos] = pl_c;
+        allocation_stage stage("multilevel search");
+        unfolded = surf.multilevel_unfolding(std::max(1, opt.threads), *obj, report, *opt.cancel);
     }
-    return pl_pc;
+    for (auto &&r : report)
+        std::cerr << "Level " << r.level << " with " << r.patches << " patches: " << r.rounds << " improvements, " << r.overlaps << " cells overlap." << std::endl;
+    uf = surf.get_bad_unfolding();
+    return unfolded;
 }
 
-// returns 0 in case of multi-layer polycube, otherwise returns index representing the planar axis
-int polycube::one_layer()
+// unfolds polycube, that no special algorithm handles, chooses between exhaustive search and heuristics by the number
+// of spanning trees, large surfaces go to the multilevel search without counting, returns the method used
+std::string unfold_general(polycube &pc, const options &opt, unfolding &uf)
 {
-    bool x = true, y = true, z = true;
-    if (!cubes.size())
-        return 1;
-    position first = cubes.begin()->first;
-    for (auto pair : cubes)
+    // the exhaustive search is automatic up to 10^30 spanning trees and gives up after 10^7 branches
+    const double exhaustive_limit = 30;
+    const long long max_nodes = 10000000;
+    const size_t multilevel_faces = 20000;
+    surface surf = pc.get_surface(opt.saddle_constraints);
+    if (opt.search == "multilevel" || (opt.search == "auto" && surf.graph.size() >= multilevel_faces))
+    {
+        std::cerr << "The surface has " << surf.graph.size() << " faces, I will unfold its planar patches first and then refine them." << std::endl;
+        unfold_multilevel(pc, opt, uf);
+        return "multilevel";
+    }
+    spanning_tree_count count;
     {
-        x &= pair.first.x == first.x;
-        y &= pair.first.y == first.y;
-        z &= pair.first.z == first.z;
+        allocation_stage stage("counting spanning trees");
+        count = surf.count_spanning_trees();
     }
-    return x ? 1 : y ? 2
-               : z   ? 3
-                     : 0;
+    if (!count.exact.empty())
+        std::cerr << "The surface has " << count.exact << " spanning trees." << std::endl;
+    else
+    {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.1f", count.log10);
+        std::cerr << "The surface has about 10^" << buffer << " spanning trees." << std::endl;
+    }
+    if (opt.search == "exhaustive" || (opt.search == "auto" && count.log10 <= exhaustive_limit))
+    {
+        std::cerr << "Searching all of them for an unfolding without overlaps..." << std::endl;
+        search_result result;
+        {
+            allocation_stage stage("exhaustive search");
+            result = surf.exhaustive_unfolding(max_nodes, *opt.cancel);
+        }
+        if (result == search_result::found)
+        {
+            uf = surf.get_bad_unfolding();
+            return "exhaustive";
+        }
+        if (result == search_result::none)
+            std::cerr << "No spanning tree unfolds without overlaps, the heuristics will find the best one." << std::endl;
+        else
+            std::cerr << "The search gave up after " << max_nodes << " branches or at the deadline, I will use heuristics." << std::endl;
+    }
+    std::cerr << "Unfolding using heuristics. This may take a while." << std::endl;
+    uf = unfold_heuristically(pc, opt);
+    return "heuristics";
 }
 
-// auxiliary function for checking connectivity
-int polycube::dfs(position pos)
+// unfolds polycube by growing spanning trees of its surface, returns false if all of them overlap
+bool unfold_grown(polycube &pc, const options &opt, unfolding &uf)
 {
-    if (!cubes.count(pos) || cubes[pos].visited)
-        return 0;
-    cubes[pos].visited = true;
-    int visited = 1;
-    for (auto neighbor : pos.neighbors())
-        visited += dfs(neighbor);
-    return visited;
+    surface surf = pc.get_surface(opt.saddle_constraints);
+    bool grown;
+    {
+        allocation_stage stage("growing unfolding");
+        grown = surf.grow_unfolding();
+    }
+    uf = surf.get_bad_unfolding();
+    return grown;
 }
 
-// returns true iff the polycube is connected
-bool polycube::connected()
+// unfolds polycube by growing spanning trees of its surface, if all of them overlap, heuristics improve the best one
+// returns false in that case
+bool unfold_by_growing(polycube &pc, const options &opt, unfolding &uf)
 {
-    for (auto pair : cubes)
-        cubes[pair.first].visited = false;
-    return !n || n == dfs(cubes.begin()->first);
+    if (unfold_grown(pc, opt, uf))
+        return true;
+    std::cerr << "All grown unfoldings overlap, I will improve the best of them using heuristics. This may take a while." << std::endl;
+    options from_grown = opt;
+    from_grown.starts = {start_strategy::grown};
+    uf = unfold_heuristically(pc, from_grown);
+    return false;
 }
 
-// reads triplets of coordinates till the EOF
-std::istream &operator>>(std::istream &is, polycube &pc)
+// unfolds one-layer polycube the same way as unfold_big_holes, the circumference is a strip with both bases attached
+// at the lowest cube and walls of holes are flaps of the bases, then the local search changes only walls of holes,
+// where some cell is enclosed from three sides, and the bases around them, returns false if overlaps remain
+bool unfold_hole_locally(polycube &pc, plane_polycube &pl_pc, const options &opt, unfolding &uf)
 {
-    position pos;
-    cube c;
-    pc.n = 0;
-    while (is >> pos.x >> pos.y >> pos.z)
+    int axis = pc.analyze().axis;
+    surface surf = pc.get_surface(opt.saddle_constraints);
+    // base faces look along the planar axis, 3d directions come in pairs for x, y and z
+    direction_3d::direction top = direction_3d::direction(2 * axis - 1), bottom = direction_3d::direction(2 * axis - 2);
+    // direction of wall in the plane, -1 for base faces
+    auto wall = [&](face f)
     {
-        c.pos = pos;
-        c.index = pc.n++;
-        pc.cubes[pos] = c;
+        plane_position pos = from_position(f.pos, axis), next = from_position(f.pos.neighbor(f.dir), axis);
+        for (int d = 0; d < 4; d++)
+            if (pos.neighbor(direction::direction(d)) == next)
+                return d;
+        return -1;
+    };
+    auto outer = [&](face f)
+    {
+        return pl_pc.board.outside(from_position(f.pos.neighbor(f.dir), axis));
+    };
+    face anchor = surf.graph.begin()->first;
+    int lowest = 1e9;
+    for (auto &&pair : surf.graph)
+    {
+        plane_position pos = from_position(pair.first.pos, axis);
+        if (wall(pair.first) == direction::down && outer(pair.first) && pos.y < lowest)
+        {
+            lowest = pos.y;
+            anchor = pair.first;
+        }
     }
-    return is;
+    // walls across one-wide gap go to different bases, as in unfold_big_holes
+    auto flap_base = [&](face f)
+    {
+        plane_position pos = from_position(f.pos, axis);
+        int d = wall(f);
+        if (d == direction::left)
+            return top;
+        if (d == direction::right)
+            return pl_pc.board.cube(pos.right().right()) ? bottom : top;
+        if (d == direction::up)
+            return bottom;
+        return pl_pc.board.cube(pos.down().down()) ? top : bottom;
+    };
+    // bases first, then the strip with its two links to the bases and the flaps, the other edges are not needed
+    auto rank = [&](face a, face b)
+    {
+        int wa = wall(a), wb = wall(b);
+        if (wa < 0 && wb < 0)
+            return a.dir == b.dir ? 0 : 2;
+        if (wa >= 0 && wb >= 0)
+            return outer(a) && outer(b) ? 1 : 2;
+        face w = wa >= 0 ? a : b, base = wa >= 0 ? b : a;
+        if (w.pos != base.pos)
+            return 2;
+        if (outer(w))
+            return w == anchor ? 1 : 2;
+        return base.dir == flap_base(w) ? 1 : 2;
+    };
+    std::unique_ptr<objective> obj = make_objective(opt.goal);
+    {
+        allocation_stage stage("hole-local search");
+        surf.ranked_spanning_tree(rank);
+        surf.try_unfold();
+    }
+    // the search changes faces of cubes at most radius steps from the problem holes, the radius doubles while overlaps remain
+    const int max_radius = 8;
+    std::set<plane_position> cells = pl_pc.problem_hole_cells(), frontier = cells;
+    std::set<face> region;
+    auto overlapping = [&]()
+    {
+        uf = surf.get_bad_unfolding();
+        int overlaps = 0;
+        for (auto &&pair : uf.squares)
+            overlaps += pair.second.type == square_type::overlap;
+        return overlaps;
+    };
+    int overlaps = overlapping(), steps = 0;
+    for (int radius = 1; overlaps && radius <= max_radius && !frontier.empty(); radius *= 2)
+    {
+        for (; steps < radius && !frontier.empty(); steps++)
+        {
+            std::set<plane_position> next;
+            for (auto pos : frontier)
+                for (auto nb : pos.neighbors())
+                    if (!cells.count(nb) && !pl_pc.board.outside(nb))
+                        next.insert(nb);
+            cells.insert(next.begin(), next.end());
+            frontier = next;
+        }
+        for (auto &&pair : surf.graph)
+            if (cells.count(from_position(pair.first.pos, axis)))
+                region.insert(pair.first);
+        std::cerr << "Searching only over " << region.size() << " of " << surf.graph.size() << " faces around the holes..." << std::endl;
+        int rounds = 0;
+        {
+            allocation_stage stage("hole-local search");
+            surf.restrict_moves([&](face a, face b)
+                                { return region.count(a) || region.count(b); });
+            while (!opt.cancel->cancelled() && surf.improve_parallel(std::max(1, opt.threads), *obj))
+                rounds++;
+        }
+        overlaps = overlapping();
+        std::cerr << "Done after " << rounds << " improvements, " << overlaps << " cells overlap." << std::endl;
+    }
+    return !overlaps;
 }
 
-// checks, whether the polycube is a polyhedron (simple connected surface)
-bool polycube::polyhedron()
+// loads polycube from file, standard input is used for empty path
+bool load_input(polycube &pc, const std::string &path, const options &opt)
 {
-    //TODO
+    allocation_stage stage("loading");
+    if (path.empty())
+    {
+        std::cin >> pc;
+        return true;
+    }
+    load_report report;
+    int threads = opt.threads ? opt.threads : std::max(1u, std::thread::hardware_concurrency());
+    if (!pc.load(path.c_str(), threads, report))
+    {
+        std::cerr << "Can't read file " << path << "." << std::endl;
+        return false;
+    }
+    if (report.duplicates)
+        std::cerr << "Skipped " << report.duplicates << " duplicate coordinates." << std::endl;
+    for (int i = 0; i < (int)report.malformed.size() && i < 10; i++)
+        std::cerr << "Malformed line " << report.malformed[i].first << " at offset " << report.malformed[i].second << "." << std::endl;
+    if (!report.malformed.empty())
+    {
+        std::cerr << "The input contains " << report.malformed.size() << " malformed lines, please fix them." << std::endl;
+        return false;
+    }
     return true;
 }
 
-int main()
+// chooses the algorithm for the polycube and unfolds it, method describes what was used
+// returns false if the polycube can't be unfolded at all
+bool unfold_polycube(polycube &pc, const options &opt, unfolding &uf, std::string &method)
 {
-    std::srand(std::time(NULL));
-    polycube pc;
-    std::cin >> pc;
     std::cerr << "Loaded polycube consisting of " << pc.n << " cubes." << std::endl;
+    {
+        allocation_stage stage("structure checks");
+        pc.analyze(std::max(1, opt.threads));
+    }
     if (pc.connected())
         std::cerr << "The polycube is connected." << std::endl;
     else
     {
         std::cerr << "The polycube is not connected, please enter a connceted polycube." << std::endl;
-        return 0;
+        method = "disconnected";
+        return false;
     }
+    if (pc.analyze().singular_edges || pc.analyze().singular_vertices)
+    {
+        std::cerr << "The surface is not a 2-manifold, " << pc.analyze().singular_edges << " edges are shared only by two diagonal cubes and ";
+        std::cerr << pc.analyze().singular_vertices << " vertices are pinched. Please enter a polyhedron." << std::endl;
+        method = "not-manifold";
+        return false;
+    }
+    if (!pc.polyhedron())
+    {
+        std::cerr << "The surface consists of " << pc.analyze().surface_components << " parts, the polycube has " << pc.analyze().surface_components - 1;
+        std::cerr << " cavities, whose walls can't be unfolded together with the outside. Please enter a polycube without cavities." << std::endl;
+        method = "cavities";
+        return false;
+    }
+    std::cerr << "The surface consists of " << pc.analyze().surface_faces << " faces, the euler characteristic is " << pc.analyze().euler << ", its genus is " << pc.analyze().genus << "." << std::endl;
     if (pc.orthotree())
         std::cerr << "The polycube is an orthotree." << std::endl;
     if (pc.one_layer())
@@ -997,62 +3926,495 @@ int main()
         std::cerr << "The polycube is one-layered." << std::endl;
         plane_polycube pl_pc = pc.to_one_layer();
         // std ::cout << pl_pc;
-        pl_pc.caluclate_circumference();
+        {
+            allocation_stage stage("circumference and holes");
+            pl_pc.caluclate_circumference();
+            pl_pc.calculate_holes();
+        }
         std::cerr << "The circumference has lenght " << pl_pc.circumference.size() << "." << std::endl;
-        pl_pc.calculate_holes();
         if (pc.orthotree())
         {
             std::cerr << "The polycube contains no holes, it can be unfolded to a 3-wide stripe." << std::endl;
-            unfolding uf = pl_pc.unfold_orthotree();
-            std::cout << uf;
+            uf = pl_pc.unfold_orthotree();
+            method = "orthotree";
         }
         else if (pl_pc.h == 0)
         {
             std::cerr << "The polycube contains no holes, it can be unfolded using simple algorithm." << std::endl;
-            unfolding uf = pl_pc.unfold_no_holes();
-            std::cout << uf;
+            uf = pl_pc.unfold_no_holes();
+            method = "no-holes";
         }
-        else if (pl_pc.h == (int)pl_pc.hole_cubes.size())
+        else if (pl_pc.h == pl_pc.board.hole_area())
         {
             std::cerr << "The polycube contains " << pl_pc.h << " holes, all of which are cubic. I can unfold this." << std::endl;
-            unfolding uf = pl_pc.unfold_1x1();
-            std::cout << uf;
+            uf = pl_pc.unfold_1x1();
+            method = "1x1-holes";
         }
         else if (pl_pc.big_holes())
         {
             std::cerr << "The polycube contains " << pl_pc.h << " holes, all of which are at least 2-wide. I can unfold this." << std::endl;
-            unfolding uf = pl_pc.unfold_big_holes();
-            std::cout << uf;
+            uf = pl_pc.unfold_big_holes();
+            method = "big-holes";
+        }
+        else if (pl_pc.flap_holes())
+        {
+            std::cerr << "The polycube contains " << pl_pc.h << " holes with one-wide gaps, but no hole cell is enclosed from three sides. I can unfold this." << std::endl;
+            uf = pl_pc.unfold_big_holes();
+            method = "narrow-holes";
         }
         else
         {
-            std::cerr << "The polycube contains " << pl_pc.h << " holes." << std::endl;
-            std::cerr << "I can't unfold general one-layer polycubes yet. However, I will try to unfold it using heuristics. This may take a while." << std::endl;
-            surface surf = pc.get_surface();
-            surf.random_spanning_tree();
-            surf.try_unfold();
-            unfolding uf = surf.get_bad_unfolding();
-            std::cerr << "Unfolding using heuristics..." << std::endl;
-            while (surf.improve())
-                ;
-            uf = surf.get_bad_unfolding();
-            std::cerr << "Done." << std::endl;
-            std::cout << uf;
+            std::cerr << "The polycube contains " << pl_pc.h << " holes, some of their cells are enclosed from three sides." << std::endl;
+            std::cerr << "Their walls don't fit into the holes, I will grow the unfolding into the free space of the plane." << std::endl;
+            if (unfold_grown(pc, opt, uf))
+                method = "grown";
+            else
+            {
+                std::cerr << "All grown unfoldings overlap, I will unfold the bases and the circumference and search only around the holes." << std::endl;
+                if (unfold_hole_locally(pc, pl_pc, opt, uf))
+                    method = "hole-local";
+                else
+                {
+                    std::cerr << "The overlaps can't be removed around the holes, I will use heuristics on the whole surface. This may take a while." << std::endl;
+                    options from_grown = opt;
+                    from_grown.starts = {start_strategy::grown};
+                    uf = unfold_heuristically(pc, from_grown);
+                    method = "heuristics";
+                }
+            }
         }
     }
+    else if (pc.orthotree())
+    {
+        // growing is a heuristic, it is not guaranteed to avoid overlaps and then the local search is the fallback
+        std::cerr << "The polycube is a multi-layer orthotree, I will try to grow its unfolding into the free space of the plane." << std::endl;
+        method = unfold_by_growing(pc, opt, uf) ? "orthotree-growth-heuristic" : "orthotree-growth-fallback";
+    }
     else
     {
-        std::cerr << "I can only unfold one-layer polycubes now. However, I will try to unfold it using heuristics. This may take a while." << std::endl;
-        surface surf = pc.get_surface();
-        surf.random_spanning_tree();
-        surf.try_unfold();
-        unfolding uf = surf.get_bad_unfolding();
-        std::cerr << "Unfolding using heuristics..." << std::endl;
-        while (surf.improve())
-            ;
-        uf = surf.get_bad_unfolding();
-        std::cerr << "Done." << std::endl;
-        std::cout << uf;
+        std::cerr << "I can only unfold one-layer polycubes and orthotrees by special algorithms." << std::endl;
+        method = unfold_general(pc, opt, uf);
+    }
+    return true;
+}
+
+// stable hash of polycube content, FNV-1a of sorted coordinates shifted to the origin
+// it does not depend on the order of lines or on the file name
+unsigned long long shape_hash(const polycube &pc)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    if (pc.cubes.empty())
+        return hash;
+    position min_pos = pc.cubes.begin()->first;
+    for (auto &&pair : pc.cubes)
+        min_pos = {std::min(min_pos.x, pair.first.x), std::min(min_pos.y, pair.first.y), std::min(min_pos.z, pair.first.z)};
+    for (auto &&pair : pc.cubes)
+    {
+        int coords[3] = {pair.first.x - min_pos.x, pair.first.y - min_pos.y, pair.first.z - min_pos.z};
+        for (int c : coords)
+        {
+            for (int byte = 0; byte < 4; byte++)
+            {
+                hash ^= (unsigned)c >> (8 * byte) & 0xff;
+                hash *= 1099511628211ULL;
+            }
+        }
+    }
+    return hash;
+}
+
+std::string hex(unsigned long long x)
+{
+    char buffer[17];
+    std::snprintf(buffer, sizeof(buffer), "%016llx", x);
+    return buffer;
+}
+
+// one shape of the corpus as written to the shard files
+struct shard_entry
+{
+    std::string hash, path;
+    int shard;
+};
+
+// processes shapes of the corpus assigned to this shard, unfoldings are written next to the inputs
+// the result file contains manifest of the whole corpus, so that the merge can check completeness
+int run_shard(const options &opt)
+{
+    std::ifstream list(opt.corpus);
+    if (!list)
+    {
+        std::cerr << "Can't read corpus " << opt.corpus << "." << std::endl;
+        return 1;
+    }
+    std::vector<std::string> paths;
+    std::string path;
+    while (std::getline(list, path))
+        if (!path.empty())
+            paths.push_back(path);
+
+    // all shapes are loaded to compute the manifest, the assignment uses only their content
+    std::vector<shard_entry> manifest;
+    for (auto &&p : paths)
+    {
+        polycube pc;
+        if (!load_input(pc, p, opt))
+            return 1;
+        unsigned long long hash = shape_hash(pc);
+        manifest.push_back({hex(hash), p, (int)(hash % opt.shards)});
+    }
+    std::string output = opt.output.empty() ? "shard-" + std::to_string(opt.shard) + "-of-" + std::to_string(opt.shards) + ".txt" : opt.output;
+    std::ofstream out(output);
+    if (!out)
+    {
+        std::cerr << "Can't write " << output << "." << std::endl;
+        return 1;
+    }
+    out << "polycube-shard 1" << std::endl;
+    out << "shard " << opt.shard << " " << opt.shards << std::endl;
+    out << "seed " << opt.seed << std::endl;
+    out << "corpus " << manifest.size() << std::endl;
+    for (auto &&e : manifest)
+        out << "shape " << e.hash << " " << e.shard << " " << e.path << std::endl;
+    // every shape is a task with its own deadline, the results are written in the order of the manifest
+    std::vector<std::string> results(manifest.size());
+    std::atomic<bool> failed(false);
+    auto process = [&](int i)
+    {
+        const shard_entry &e = manifest[i];
+        std::cerr << "Processing " << e.path << "." << std::endl;
+        polycube pc;
+        if (!load_input(pc, e.path, opt))
+        {
+            failed = true;
+            return;
+        }
+        options shape = opt;
+        shape.cancel = std::make_shared<cancel_token>(opt.deadline);
+        random_engine.seed(opt.seed);
+        unfolding uf;
+        std::string method;
+        int overlaps = 0;
+        if (unfold_polycube(pc, shape, uf, method))
+        {
+            std::ofstream svg(e.path + ".svg");
+            svg << uf;
+            for (auto &&pair : uf.squares)
+                overlaps += pair.second.type == square_type::overlap;
+        }
+        std::ostringstream line;
+        line << "result " << e.hash << " " << pc.n << " " << method << " " << uf.squares.size() << " " << overlaps << " " << e.path;
+        results[i] = line.str();
+    };
+    task_group shapes(scheduler());
+    for (int i = 0; i < (int)manifest.size(); i++)
+        if (manifest[i].shard == opt.shard)
+            shapes.spawn([&process, i]()
+                         { process(i); });
+    shapes.wait();
+    if (failed)
+        return 1;
+    for (auto &&line : results)
+        if (!line.empty())
+            out << line << std::endl;
+    out << "end" << std::endl;
+    std::cerr << "Results written to " << output << "." << std::endl;
+    return 0;
+}
+
+// combines result files of all shards into one report, checks that every shape was processed exactly once
+int merge_shards(const std::vector<std::string> &files)
+{
+    int shards = -1;
+    std::set<int> seen_shards;
+    std::map<std::pair<std::string, std::string>, int> expected;
+    std::map<std::pair<std::string, std::string>, std::vector<std::string>> results;
+    bool ok = true;
+    for (auto &&file : files)
+    {
+        std::ifstream in(file);
+        std::string line, word;
+        if (!in || !std::getline(in, line) || line != "polycube-shard 1")
+        {
+            std::cerr << file << " is not a shard result file." << std::endl;
+            ok = false;
+            continue;
+        }
+        bool finished = false;
+        while (std::getline(in, line))
+        {
+            std::istringstream ls(line);
+            ls >> word;
+            if (word == "shard")
+            {
+                int shard, count;
+                ls >> shard >> count;
+                if (shards >= 0 && count != shards)
+                {
+                    std::cerr << file << " belongs to a run with " << count << " shards instead of " << shards << "." << std::endl;
+                    ok = false;
+                }
+                shards = count;
+                if (!seen_shards.insert(shard).second)
+                {
+                    std::cerr << "Shard " << shard << " is contained in more files." << std::endl;
+                    ok = false;
+                }
+            }
+            else if (word == "shape")
+            {
+                std::string hash, path;
+                int shard;
+                ls >> hash >> shard >> std::ws;
+                std::getline(ls, path);
+                expected[{hash, path}] = shard;
+            }
+            else if (word == "result")
+            {
+                std::string hash, path;
+                ls >> hash;
+                // the path is the last field and may contain spaces
+                std::string fields[4];
+                for (auto &&f : fields)
+                    ls >> f;
+                ls >> std::ws;
+                std::getline(ls, path);
+                results[{hash, path}].push_back(fields[0] + " " + fields[1] + " " + fields[2] + " " + fields[3]);
+            }
+            else if (word == "end")
+                finished = true;
+        }
+        if (!finished)
+        {
+            std::cerr << file << " is incomplete, the run was probably interrupted." << std::endl;
+            ok = false;
+        }
     }
+    for (int i = 0; i < shards; i++)
+    {
+        if (!seen_shards.count(i))
+        {
+            std::cerr << "Results of shard " << i << "/" << shards << " are missing." << std::endl;
+            ok = false;
+        }
+    }
+
+    std::cout << "hash cubes method squares overlaps path" << std::endl;
+    int missing = 0, twice = 0;
+    for (auto &&pair : expected)
+    {
+        auto it = results.find(pair.first);
+        if (it == results.end())
+        {
+            std::cerr << "Shape " << pair.first.second << " (" << pair.first.first << ") was not processed." << std::endl;
+            missing++;
+            continue;
+        }
+        if (it->second.size() > 1)
+        {
+            std::cerr << "Shape " << pair.first.second << " (" << pair.first.first << ") was processed " << it->second.size() << " times." << std::endl;
+            twice++;
+        }
+        std::cout << pair.first.first << " " << it->second[0] << " " << pair.first.second << std::endl;
+    }
+    for (auto &&pair : results)
+    {
+        if (!expected.count(pair.first))
+        {
+            std::cerr << "Shape " << pair.first.second << " (" << pair.first.first << ") is not part of the corpus." << std::endl;
+            ok = false;
+        }
+    }
+    // how often each method was used, e.g. how many orthotrees needed the fallback of the growth
+    std::map<std::string, int> methods;
+    for (auto &&pair : results)
+    {
+        std::istringstream fields(pair.second[0]);
+        std::string cubes, method;
+        fields >> cubes >> method;
+        methods[method]++;
+    }
+    for (auto &&pair : methods)
+        std::cerr << "Method " << pair.first << " was used for " << pair.second << " shapes." << std::endl;
+    std::cerr << "Merged " << expected.size() - missing << " of " << expected.size() << " shapes, " << missing << " missing, " << twice << " processed more times." << std::endl;
+    return ok && !missing && !twice ? 0 : 1;
+}
+
+// polycube from lines of coordinates
+polycube read_polycube(const std::string &text)
+{
+    polycube pc;
+    std::istringstream is(text);
+    is >> pc;
+    return pc;
+}
+
+// coordinates of box a x b x c without the listed cubes
+std::string box_cubes(int a, int b, int c, const std::set<position> &skip = {})
+{
+    std::ostringstream os;
+    for (int x = 0; x < a; x++)
+        for (int y = 0; y < b; y++)
+            for (int z = 0; z < c; z++)
+                if (!skip.count({x, y, z}))
+                    os << x << " " << y << " " << z << "\n";
+    return os.str();
+}
+
+// random multi-layer orthotree, every new cube touches exactly one cube of the tree
+std::string orthotree_cubes(int n, unsigned seed)
+{
+    std::mt19937 engine(seed);
+    std::vector<position> tree = {{0, 0, 0}};
+    std::set<position> cubes(tree.begin(), tree.end());
+    const position steps[6] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+    while ((int)tree.size() < n)
+    {
+        position from = tree[engine() % tree.size()], step = steps[engine() % 6];
+        position next = {from.x + step.x, from.y + step.y, from.z + step.z};
+        // cubes around the new one may only touch it along an edge shared with the cube it grows from
+        bool fits = !cubes.count(next);
+        for (int dx = -1; dx <= 1; dx++)
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dz = -1; dz <= 1; dz++)
+                {
+                    position p = {next.x + dx, next.y + dy, next.z + dz};
+                    int steps_to_p = std::abs(dx) + std::abs(dy) + std::abs(dz);
+                    bool through_from = std::abs(p.x - from.x) + std::abs(p.y - from.y) + std::abs(p.z - from.z) == 1;
+                    if (steps_to_p && cubes.count(p) && !(p == from) && (steps_to_p != 2 || !through_from))
+                        fits = false;
+                }
+        if (!fits)
+            continue;
+        tree.push_back(next);
+        cubes.insert(next);
+    }
+    std::ostringstream os;
+    for (auto &&p : tree)
+        os << p.x << " " << p.y << " " << p.z << "\n";
+    return os.str();
+}
+
+// checks structure analysis and the spanning tree counter on small polycubes with known answers, returns the exit status
+int self_test()
+{
+    int failed = 0;
+    auto check = [&](const std::string &name, bool ok)
+    {
+        std::cerr << (ok ? "ok      " : "FAILED  ") << name << std::endl;
+        failed += !ok;
+    };
+
+    // the surface of box is a sphere, the ring has one handle
+    polycube cube = read_polycube(box_cubes(1, 1, 1));
+    check("cube is a polyhedron of genus 0", cube.polyhedron() && cube.analyze().surface_components == 1 && cube.analyze().genus == 0);
+    polycube ring = read_polycube(box_cubes(3, 3, 1, {{1, 1, 0}}));
+    check("ring is a polyhedron of genus 1", ring.polyhedron() && ring.analyze().genus == 1);
+    polycube tunnels = read_polycube(box_cubes(5, 5, 1, {{1, 1, 0}, {3, 3, 0}}));
+    check("slab with two holes has genus 2", tunnels.polyhedron() && tunnels.analyze().genus == 2);
+    // two cubes touching along an edge and at a vertex, both joined through other cubes
+    polycube edge = read_polycube("0 0 0\n0 0 1\n1 0 1\n1 1 1\n1 1 0\n");
+    check("cubes sharing only an edge are not a polyhedron", edge.connected() && edge.analyze().singular_edges == 1 && !edge.polyhedron());
+    polycube pinch = read_polycube("0 0 0\n-1 0 0\n-1 0 1\n-1 0 2\n0 0 2\n1 0 2\n1 1 2\n1 1 1\n");
+    check("cubes sharing only a vertex are not a polyhedron", pinch.connected() && !pinch.analyze().singular_edges && pinch.analyze().singular_vertices == 1 && !pinch.polyhedron());
+    // the cavity is a second sphere of the surface, not a negative genus
+    polycube hollow = read_polycube(box_cubes(3, 3, 3, {{1, 1, 1}}));
+    check("hollow cube has two surface parts and genus 0", hollow.connected() && hollow.analyze().surface_components == 2 && hollow.analyze().genus == 0);
+    check("hollow cube is not a polyhedron", !hollow.analyze().singular_edges && !hollow.analyze().singular_vertices && !hollow.polyhedron());
+    polycube apart = read_polycube("0 0 0\n2 0 0\n");
+    check("separate cubes are not connected", !apart.connected() && apart.analyze().components == 2);
+
+    // holes of one-layer polycubes from the bitboard, their number, area and width
+    auto holes = [](polycube &pc, int h, int area, int circumference, bool big)
+    {
+        plane_polycube pl_pc = pc.to_one_layer();
+        pl_pc.caluclate_circumference();
+        pl_pc.calculate_holes();
+        return pl_pc.h == h && pl_pc.board.hole_area() == area && (int)pl_pc.circumference.size() == circumference && pl_pc.big_holes() == big;
+    };
+    check("ring has one 1x1 hole", holes(ring, 1, 1, 12, false));
+    check("slab has two 1x1 holes", holes(tunnels, 2, 2, 20, false));
+    polycube frame = read_polycube(box_cubes(4, 4, 1, {{1, 1, 0}, {1, 2, 0}, {2, 1, 0}, {2, 2, 0}}));
+    check("frame has one 2x2 hole", holes(frame, 1, 4, 16, true));
+
+    // the counts were computed independently by exact rational elimination of the laplacians
+    const std::vector<std::pair<std::string, std::string>> counts = {
+        {box_cubes(1, 1, 1), "384"},
+        {box_cubes(2, 2, 2), "301056000000"},
+        {box_cubes(3, 3, 3), "345242277551913886543872000"},
+        {box_cubes(3, 3, 1, {{1, 1, 0}}), "2750310430801920"},
+    };
+    for (auto &&pair : counts)
+    {
+        polycube pc = read_polycube(pair.first);
+        spanning_tree_count count = pc.get_surface().count_spanning_trees();
+        check("surface of " + std::to_string(pc.n) + " cubes has " + pair.second + " spanning trees", count.exact == pair.second && std::abs(count.log10 - std::log10(std::stod(pair.second))) < 1e-6);
+    }
+    // the surface of the cavity is not connected to the outer one, no prime gives a nonzero determinant
+    spanning_tree_count hollow_count = hollow.get_surface().count_spanning_trees();
+    check("hollow cube has no spanning tree", hollow_count.exact == "0");
+
+    // far apart cells are kept in the hash map and overlap the same as a dense bitmap
+    std::vector<plane_position> far = {{0, 0}, {1, 0}, {100000, 3}, {-70000, 50000}}, near = {{1, 0}, {2, 0}, {1, 1}};
+    cell_bitmap sparse(far), dense(near);
+    check("sparse bitmap overlaps shifted cells", sparse.sparse && !dense.sparse && sparse.overlap(dense, -1, 0) == 2 && sparse.overlap(dense, 0, 0) == 1 && sparse.overlap(dense, 99999, 3) == 1 && sparse.overlap(dense, 5, 5) == 0);
+
+    // growing is only a heuristic for orthotrees, the report shows how often unfold_polycube falls back to the local search
+    int orthotrees = 0, fallbacks = 0;
+    bool grown_ok = true;
+    for (unsigned seed = 1; orthotrees < 40; seed++)
+    {
+        polycube tree = read_polycube(orthotree_cubes(8 + seed % 56, seed));
+        if (tree.one_layer() || !tree.orthotree() || !tree.polyhedron())
+            continue;
+        orthotrees++;
+        random_engine.seed(seed);
+        unfolding uf;
+        bool grown = unfold_grown(tree, options(), uf);
+        for (auto &&pair : uf.squares)
+            grown_ok &= !grown || pair.second.type != square_type::overlap;
+        fallbacks += !grown;
+    }
+    check("grown unfoldings of orthotrees have no overlaps", grown_ok && orthotrees);
+    std::cerr << "        the orthotree growth needed the fallback for " << fallbacks << " of " << orthotrees << " random multi-layer orthotrees" << std::endl;
+
+    std::cerr << (failed ? std::to_string(failed) + " checks failed." : std::string("All checks passed.")) << std::endl;
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    options opt;
+    if (!parse_options(argc, argv, opt))
+    {
+        std::cerr << "Usage: " << argv[0] << " [--threads N] [--seed S] [--start random|bands|greedy|grown|compare] [--objective classic|overlaps|bbox|folds] [--search auto|exhaustive|heuristic|multilevel] [--deadline SECONDS] [--saddle-constraints] [--scheduler-stats] [--input FILE | < polycube]" << std::endl;
+        std::cerr << "       " << argv[0] << " --corpus LIST --shard I/N [--output FILE] [options]" << std::endl;
+        std::cerr << "       " << argv[0] << " --merge FILE..." << std::endl;
+        std::cerr << "       " << argv[0] << " --self-test" << std::endl;
+        return 1;
+    }
+    if (opt.self_test)
+        return self_test();
+    if (!opt.merge.empty())
+        return merge_shards(opt.merge);
+    scheduler().start(std::max(1, opt.threads));
+    if (!opt.corpus.empty())
+    {
+        int status = run_shard(opt);
+        if (opt.scheduler_stats)
+            scheduler().print_stats(std::cerr);
+        return status;
+    }
+    random_engine.seed(opt.seed);
+    polycube pc;
+    if (!load_input(pc, opt.input, opt))
+        return 1;
+    opt.cancel = std::make_shared<cancel_token>(opt.deadline);
+    unfolding uf;
+    std::string method;
+    if (unfold_polycube(pc, opt, uf, method))
+        std::cout << uf;
+    if (opt.scheduler_stats)
+        scheduler().print_stats(std::cerr);
     return 0;
 }